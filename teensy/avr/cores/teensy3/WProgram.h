@@ -66,6 +66,7 @@
 #include "usb_touch.h"
 
 #include "usb_xinput.h"
+#include "usb_stats.h"
 
 #include "usb_undef.h" // do not allow usb_desc.h stuff to leak to user programs
 
@@ -68,7 +68,7 @@
 
 // USB Device Descriptor.  The USB host reads this first, to learn
 // what type of device is connected.
-static uint8_t device_descriptor[] = {
+static const uint8_t device_descriptor[] = {
         18,                                     // bLength
         1,                                      // bDescriptorType
 #ifdef BCD_USB
@@ -135,7 +135,7 @@ static uint8_t device_descriptor[] = {
 
 #ifdef KEYBOARD_INTERFACE
 // Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
-static uint8_t keyboard_report_desc[] = {
+static const uint8_t keyboard_report_desc[] = {
         0x05, 0x01,                     // Usage Page (Generic Desktop),
         0x09, 0x06,                     // Usage (Keyboard),
         0xA1, 0x01,                     // Collection (Application),
@@ -172,7 +172,7 @@ static uint8_t keyboard_report_desc[] = {
 #endif
 
 #ifdef KEYMEDIA_INTERFACE
-static uint8_t keymedia_report_desc[] = {
+static const uint8_t keymedia_report_desc[] = {
         0x05, 0x0C,                     // Usage Page (Consumer)
         0x09, 0x01,                     // Usage (Consumer Controls)
         0xA1, 0x01,                     // Collection (Application)
@@ -197,7 +197,7 @@ static uint8_t keymedia_report_desc[] = {
 
 #ifdef MOUSE_INTERFACE
 // Mouse Protocol 1, HID 1.11 spec, Appendix B, page 59-60, with wheel extension
-static uint8_t mouse_report_desc[] = {
+static const uint8_t mouse_report_desc[] = {
         0x05, 0x01,                     // Usage Page (Generic Desktop)
         0x09, 0x02,                     // Usage (Mouse)
         0xA1, 0x01,                     // Collection (Application)
@@ -245,7 +245,7 @@ static uint8_t mouse_report_desc[] = {
 
 #ifdef JOYSTICK_INTERFACE
 #if JOYSTICK_SIZE == 12
-static uint8_t joystick_report_desc[] = {
+static const uint8_t joystick_report_desc[] = {
         0x05, 0x01,                     // Usage Page (Generic Desktop)
         0x09, 0x04,                     // Usage (Joystick)
         0xA1, 0x01,                     // Collection (Application)
@@ -295,7 +295,7 @@ static uint8_t joystick_report_desc[] = {
 //    6 axes      12
 //   17 sliders   34
 //    4 pov        2
-static uint8_t joystick_report_desc[] = {
+static const uint8_t joystick_report_desc[] = {
         0x05, 0x01,                     // Usage Page (Generic Desktop)
         0x09, 0x04,                     // Usage (Joystick)
         0xA1, 0x01,                     // Collection (Application)
@@ -364,7 +364,7 @@ static uint8_t joystick_report_desc[] = {
 // https://msdn.microsoft.com/en-us/library/windows/hardware/ff553734%28v=vs.85%29.aspx
 // https://msdn.microsoft.com/en-us/library/windows/hardware/jj151564%28v=vs.85%29.aspx
 // download.microsoft.com/download/a/d/f/adf1347d-08dc-41a4-9084-623b1194d4b2/digitizerdrvs_touch.docx
-static uint8_t multitouch_report_desc[] = {
+static const uint8_t multitouch_report_desc[] = {
         0x05, 0x0D,                     // Usage Page (Digitizer)
         0x09, 0x04,                     // Usage (Touch Screen)
         0xa1, 0x01,                     // Collection (Application)
@@ -417,7 +417,7 @@ static uint8_t multitouch_report_desc[] = {
 #endif
 
 #ifdef SEREMU_INTERFACE
-static uint8_t seremu_report_desc[] = {
+static const uint8_t seremu_report_desc[] = {
         0x06, 0xC9, 0xFF,               // Usage Page 0xFFC9 (vendor defined)
         0x09, 0x04,                     // Usage 0x04
         0xA1, 0x5C,                     // Collection 0x5C
@@ -438,7 +438,7 @@ static uint8_t seremu_report_desc[] = {
 #endif
 
 #ifdef RAWHID_INTERFACE
-static uint8_t rawhid_report_desc[] = {
+static const uint8_t rawhid_report_desc[] = {
         0x06, LSB(RAWHID_USAGE_PAGE), MSB(RAWHID_USAGE_PAGE),
         0x0A, LSB(RAWHID_USAGE), MSB(RAWHID_USAGE),
         0xA1, 0x01,                     // Collection 0x01
@@ -456,7 +456,7 @@ static uint8_t rawhid_report_desc[] = {
 #endif
 
 #ifdef FLIGHTSIM_INTERFACE
-static uint8_t flightsim_report_desc[] = {
+static const uint8_t flightsim_report_desc[] = {
         0x06, 0x1C, 0xFF,               // Usage page = 0xFF1C
         0x0A, 0x39, 0xA7,               // Usage = 0xA739
         0xA1, 0x01,                     // Collection 0x01
@@ -484,7 +484,7 @@ static uint8_t flightsim_report_desc[] = {
 
 #define XINPUT_INTERFACE_DESC_POS   CONFIG_HEADER_DESCRIPTOR_SIZE
 #ifdef XINPUT_INTERFACE
-#define XINPUT_INTERFACE_DESC_SIZE      9+17+7+7 // 40 0x28
+#define XINPUT_INTERFACE_DESC_SIZE      (9+17+7+7) * XINPUT_COUNT // 40 0x28 each
 #else
 #define XINPUT_INTERFACE_DESC_SIZE      0
 #endif     
@@ -615,9 +615,20 @@ static uint8_t flightsim_report_desc[] = {
 //   USB Configuration
 // **************************************************************
 
+#if defined(XINPUT_INTERFACE) && XINPUT_COUNT > 1
+// Controllers after the first have the same interface as interface 0
+// below, with their own interface number and endpoint pair
+#define XINPUT_EXTRA_INTERFACE_DESC(n) \
+        9, 4, XINPUT_INTERFACE + (n), 0, 2, 0xFF, 0x5D, 0x01, 0, \
+        17, 33, 0, 1, 1, 37, XINPUT_TX_ENDPOINT_N(n) | 0x80, 20, 0, 0, 0, 0, 19, \
+        XINPUT_RX_ENDPOINT_N(n), 8, 0, 0, \
+        7, 5, XINPUT_TX_ENDPOINT_N(n) | 0x80, 0x03, 0x20, 0x00, 1, \
+        7, 5, XINPUT_RX_ENDPOINT_N(n), 0x03, 0x20, 0x00, 8
+#endif
+
 // USB Configuration Descriptor.  This huge descriptor tells all
 // of the devices capbilities.
-static uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
+static const uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
         // configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
         9,                                      // bLength;
         2,                                      // bDescriptorType;
@@ -669,6 +680,15 @@ static uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
         0x20, 0x00,                             // wMaxPacketSize (0x0020 is 1x32 bytes)
         8,                                      // bInterval (not changed since this is the RX endpoint)
         // Other interfaces originally defined in ArduinoXInput_Teensy are not necessary
+#if XINPUT_COUNT >= 2
+        XINPUT_EXTRA_INTERFACE_DESC(1),
+#endif
+#if XINPUT_COUNT >= 3
+        XINPUT_EXTRA_INTERFACE_DESC(2),
+#endif
+#if XINPUT_COUNT >= 4
+        XINPUT_EXTRA_INTERFACE_DESC(3),
+#endif
 #endif // XINPUT_INTERFACE
 
 #ifdef CDC_IAD_DESCRIPTOR
@@ -1654,16 +1674,15 @@ where XXX... is your VID+PID+BCD_VERSION (firmware version).
 osvc will be set to 0x01XX where XX is VENDOR_CODE
 */
 
-usb_os_string_descriptor_t usb_os_string_descriptor = {
+// Kept as 8-bit characters, see usb_string8_descriptor_struct: the
+// vendor code widens to bMS_VendorCode followed by the zero bPad.
+#ifndef VENDOR_CODE
+#define VENDOR_CODE 0xA5
+#endif
+static const struct usb_string8_descriptor_struct usb_os_string_descriptor8 = {
     .bLength = 0x12,
-    .bDescriptorType = 0x03,
-    .qwSignature = {0x4D, 0x00, 0x53, 0x00, 0x46, 0x00, 0x54, 0x00, 0x31, 0x00, 0x30, 0x00, 0x30, 0x00},  //'MSFT100'
-    #ifdef VENDOR_CODE
-    .bMS_VendorCode = VENDOR_CODE,
-    #else
-    .bMS_VendorCode = 0xA5,
-    #endif
-    .bPad = 0x00
+    .bDescriptorType = USB_STRING8_TYPE,
+    .str = {'M', 'S', 'F', 'T', '1', '0', '0', VENDOR_CODE}
 };
 
 // should not be used unless device supports high speed mode
@@ -1730,6 +1749,28 @@ const usb_extended_compat_id_descriptor_t usb_extended_compat_id_descriptor = {
             .subCompatibleID = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
             .bRESERVED1 = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
         },
+        #elif defined(USB_XINPUT_QUAD)
+        {
+            .bFirstInterfaceNumber = 0x01,
+            .bRESERVED0 = 0x01,
+            .compatibleID = {0x58, 0x55, 0x53, 0x42, 0x31, 0x30, 0x00, 0x00},
+            .subCompatibleID = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+            .bRESERVED1 = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+        },
+        {
+            .bFirstInterfaceNumber = 0x02,
+            .bRESERVED0 = 0x01,
+            .compatibleID = {0x58, 0x55, 0x53, 0x42, 0x31, 0x30, 0x00, 0x00},
+            .subCompatibleID = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+            .bRESERVED1 = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+        },
+        {
+            .bFirstInterfaceNumber = 0x03,
+            .bRESERVED0 = 0x01,
+            .compatibleID = {0x58, 0x55, 0x53, 0x42, 0x31, 0x30, 0x00, 0x00},
+            .subCompatibleID = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+            .bRESERVED1 = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+        },
         #elif defined(USB_XINPUT_SERIAL) || defined(USB_XINPUT_DIRECTINPUT) // or any 2 interface xinput usb type
         {
             .bFirstInterfaceNumber = 0x01,
@@ -1760,6 +1801,10 @@ struct usb_string_descriptor_struct {
 };
 */
 
+// The built-in strings are 8-bit, in flash (except the serial number,
+// filled in at runtime), and sent as UTF-16; see usb_desc.h.  A sketch
+// replacing a name with its own usb_string_descriptor_struct is sent
+// as it is.
 extern struct usb_string_descriptor_struct usb_string_manufacturer_name
         __attribute__ ((weak, alias("usb_string_manufacturer_name_default")));
 extern struct usb_string_descriptor_struct usb_string_product_name
@@ -1767,31 +1812,31 @@ extern struct usb_string_descriptor_struct usb_string_product_name
 extern struct usb_string_descriptor_struct usb_string_serial_number
         __attribute__ ((weak, alias("usb_string_serial_number_default")));
 
-struct usb_string_descriptor_struct string0 = {
+static const struct usb_string_descriptor_struct string0 = {
         4,
         3,
         {0x0409}
 };
 
-struct usb_string_descriptor_struct usb_string_manufacturer_name_default = {
+const struct usb_string8_descriptor_struct usb_string_manufacturer_name_default = {
         2 + MANUFACTURER_NAME_LEN * 2,
-        3,
+        USB_STRING8_TYPE,
         MANUFACTURER_NAME
 };
-struct usb_string_descriptor_struct usb_string_product_name_default = {
+const struct usb_string8_descriptor_struct usb_string_product_name_default = {
 	2 + PRODUCT_NAME_LEN * 2,
-        3,
+        USB_STRING8_TYPE,
         PRODUCT_NAME
 };
-struct usb_string_descriptor_struct usb_string_serial_number_default = {
+struct usb_string8_descriptor_struct usb_string_serial_number_default = {
         12,
-        3,
+        USB_STRING8_TYPE,
         {0,0,0,0,0,0,0,0,0,0}
 };
 #ifdef XINPUT_INTERFACE
-struct usb_string_descriptor_struct usb_string_xinput_security_descriptor = {
+static const struct usb_string8_descriptor_struct usb_string_xinput_security_descriptor = {
         2 + 88 * 2,
-        3,
+        USB_STRING8_TYPE,
         {
             'X', 'b', 'o', 'x', ' ', 'S', 'e', 'c', 'u', 'r', 'i', 't', 'y', ' ', 'M', 'e',
             't', 'h', 'o', 'd', ' ', '3', ',', ' ', 'V', 'e', 'r', 's', 'i', 'o', 'n', ' ',
@@ -1803,18 +1848,22 @@ struct usb_string_descriptor_struct usb_string_xinput_security_descriptor = {
 };
 #endif
 #ifdef MTP_INTERFACE
-struct usb_string_descriptor_struct usb_string_mtp = {
+static const struct usb_string8_descriptor_struct usb_string_mtp = {
 	2 + 3 * 2,
-	3,
+	USB_STRING8_TYPE,
 	{'M','T','P'}
 };
 #endif
 
+// Function reads the serial number from the flash ID registers, once.
+// usb_init() calls it after enabling the pullup rather than before.
 void usb_init_serialnumber(void)
 {
+	static uint8_t done = 0;
 	char buf[11];
 	uint32_t i, num;
 
+	if (done) return;
 	__disable_irq();
 #if defined(HAS_KINETIS_FLASH_FTFA) || defined(HAS_KINETIS_FLASH_FTFL)
 	FTFL_FSTAT = FTFL_FSTAT_RDCOLERR | FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL;
@@ -1839,9 +1888,10 @@ void usb_init_serialnumber(void)
 	for (i=0; i<10; i++) {
 		char c = buf[i];
 		if (!c) break;
-		usb_string_serial_number_default.wString[i] = c;
+		usb_string_serial_number_default.str[i] = c;
 	}
 	usb_string_serial_number_default.bLength = i * 2 + 2;
+	done = 1;
 }
 
 
@@ -1849,61 +1899,125 @@ void usb_init_serialnumber(void)
 //   Descriptors List
 // **************************************************************
 
-// This table provides access to all the descriptor data above.
+// These tables provide access to all the descriptor data above, laid
+// out so usb_descriptor_lookup() finds each one by its type and index
+// without searching.  A length of 0 means a string descriptor whose
+// length is only known at runtime (the names can be replaced by the
+// sketch, the serial number is filled in by usb_init_serialnumber), so
+// its bLength is used.
 
-const usb_descriptor_list_t usb_descriptor_list[] = {
+// Device and configuration, by type - 1
+static const usb_descriptor_list_t usb_device_descriptor_list[2] = {
 	//wValue, wIndex, address,          length
 	{0x0100, 0x0000, device_descriptor, sizeof(device_descriptor)},
 	{0x0200, 0x0000, config_descriptor, sizeof(config_descriptor)},
+};
+
+// Strings, by index
+static const usb_descriptor_list_t usb_string_descriptor_list[] = {
+	{0x0300, 0x0000, (const uint8_t *)&string0, 4},
+	{0x0301, 0x0409, (const uint8_t *)&usb_string_manufacturer_name, 0},
+	{0x0302, 0x0409, (const uint8_t *)&usb_string_product_name, 0},
+	{0x0303, 0x0409, (const uint8_t *)&usb_string_serial_number, 0},
+#if defined(MTP_INTERFACE)
+	{0x0304, 0x0409, (const uint8_t *)&usb_string_mtp, 2 + 3 * 2},
+#elif defined(XINPUT_INTERFACE)
+	{0x0304, 0x0409, (const uint8_t *)&usb_string_xinput_security_descriptor, 2 + 88 * 2},
+#endif
+};
+
+#ifdef OS_DESC_VERSION
+static const usb_descriptor_list_t usb_os_string_descriptor_list =
+	{0x03EE, 0x0000, (const uint8_t *)&usb_os_string_descriptor8, 0x12};
+#endif
+
+// HID and HID report descriptors, by interface number and type - 0x21
+static const usb_descriptor_list_t usb_hid_descriptor_list[NUM_INTERFACE][2] = {
 #ifdef SEREMU_INTERFACE
-	{0x2200, SEREMU_INTERFACE, seremu_report_desc, sizeof(seremu_report_desc)},
-	{0x2100, SEREMU_INTERFACE, config_descriptor+SEREMU_HID_DESC_OFFSET, 9},
+	[SEREMU_INTERFACE] = {
+		{0x2100, SEREMU_INTERFACE, config_descriptor+SEREMU_HID_DESC_OFFSET, 9},
+		{0x2200, SEREMU_INTERFACE, seremu_report_desc, sizeof(seremu_report_desc)}
+	},
 #endif
 #ifdef KEYBOARD_INTERFACE
-        {0x2200, KEYBOARD_INTERFACE, keyboard_report_desc, sizeof(keyboard_report_desc)},
-        {0x2100, KEYBOARD_INTERFACE, config_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
+	[KEYBOARD_INTERFACE] = {
+		{0x2100, KEYBOARD_INTERFACE, config_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
+		{0x2200, KEYBOARD_INTERFACE, keyboard_report_desc, sizeof(keyboard_report_desc)}
+	},
 #endif
 #ifdef MOUSE_INTERFACE
-        {0x2200, MOUSE_INTERFACE, mouse_report_desc, sizeof(mouse_report_desc)},
-        {0x2100, MOUSE_INTERFACE, config_descriptor+MOUSE_HID_DESC_OFFSET, 9},
+	[MOUSE_INTERFACE] = {
+		{0x2100, MOUSE_INTERFACE, config_descriptor+MOUSE_HID_DESC_OFFSET, 9},
+		{0x2200, MOUSE_INTERFACE, mouse_report_desc, sizeof(mouse_report_desc)}
+	},
 #endif
 #ifdef JOYSTICK_INTERFACE
-        {0x2200, JOYSTICK_INTERFACE, joystick_report_desc, sizeof(joystick_report_desc)},
-        {0x2100, JOYSTICK_INTERFACE, config_descriptor+JOYSTICK_HID_DESC_OFFSET, 9},
+	[JOYSTICK_INTERFACE] = {
+		{0x2100, JOYSTICK_INTERFACE, config_descriptor+JOYSTICK_HID_DESC_OFFSET, 9},
+		{0x2200, JOYSTICK_INTERFACE, joystick_report_desc, sizeof(joystick_report_desc)}
+	},
 #endif
 #ifdef RAWHID_INTERFACE
-	{0x2200, RAWHID_INTERFACE, rawhid_report_desc, sizeof(rawhid_report_desc)},
-	{0x2100, RAWHID_INTERFACE, config_descriptor+RAWHID_HID_DESC_OFFSET, 9},
+	[RAWHID_INTERFACE] = {
+		{0x2100, RAWHID_INTERFACE, config_descriptor+RAWHID_HID_DESC_OFFSET, 9},
+		{0x2200, RAWHID_INTERFACE, rawhid_report_desc, sizeof(rawhid_report_desc)}
+	},
 #endif
 #ifdef FLIGHTSIM_INTERFACE
-	{0x2200, FLIGHTSIM_INTERFACE, flightsim_report_desc, sizeof(flightsim_report_desc)},
-	{0x2100, FLIGHTSIM_INTERFACE, config_descriptor+FLIGHTSIM_HID_DESC_OFFSET, 9},
+	[FLIGHTSIM_INTERFACE] = {
+		{0x2100, FLIGHTSIM_INTERFACE, config_descriptor+FLIGHTSIM_HID_DESC_OFFSET, 9},
+		{0x2200, FLIGHTSIM_INTERFACE, flightsim_report_desc, sizeof(flightsim_report_desc)}
+	},
 #endif
 #ifdef KEYMEDIA_INTERFACE
-        {0x2200, KEYMEDIA_INTERFACE, keymedia_report_desc, sizeof(keymedia_report_desc)},
-        {0x2100, KEYMEDIA_INTERFACE, config_descriptor+KEYMEDIA_HID_DESC_OFFSET, 9},
+	[KEYMEDIA_INTERFACE] = {
+		{0x2100, KEYMEDIA_INTERFACE, config_descriptor+KEYMEDIA_HID_DESC_OFFSET, 9},
+		{0x2200, KEYMEDIA_INTERFACE, keymedia_report_desc, sizeof(keymedia_report_desc)}
+	},
 #endif
 #ifdef MULTITOUCH_INTERFACE
-        {0x2200, MULTITOUCH_INTERFACE, multitouch_report_desc, sizeof(multitouch_report_desc)},
-        {0x2100, MULTITOUCH_INTERFACE, config_descriptor+MULTITOUCH_HID_DESC_OFFSET, 9},
+	[MULTITOUCH_INTERFACE] = {
+		{0x2100, MULTITOUCH_INTERFACE, config_descriptor+MULTITOUCH_HID_DESC_OFFSET, 9},
+		{0x2200, MULTITOUCH_INTERFACE, multitouch_report_desc, sizeof(multitouch_report_desc)}
+	},
 #endif
-#ifdef MTP_INTERFACE
-	{0x0304, 0x0409, (const uint8_t *)&usb_string_mtp, 0},
-#endif
-        {0x0300, 0x0000, (const uint8_t *)&string0, 0},
-        {0x0301, 0x0409, (const uint8_t *)&usb_string_manufacturer_name, 0},
-        {0x0302, 0x0409, (const uint8_t *)&usb_string_product_name, 0},
-        {0x0303, 0x0409, (const uint8_t *)&usb_string_serial_number, 0},
-#ifdef XINPUT_INTERFACE
-	{0x0304, 0x0409, (const uint8_t *)&usb_string_xinput_security_descriptor, 0},
-#endif
-#ifdef OS_DESC_VERSION
-    {0x3EE, 0x0000, (const uint8_t *)&usb_os_string_descriptor, 0},
-#endif
-	{0, 0, NULL, 0}
-    }
 };
 
+// Function returns the descriptor for a GET_DESCRIPTOR request, or NULL
+// if there is none, in constant time
+const usb_descriptor_list_t * usb_descriptor_lookup(uint16_t wValue, uint16_t wIndex)
+{
+	const usb_descriptor_list_t *list;
+	uint32_t n = wValue & 0xFF;
+
+	switch (wValue >> 8) {
+	  case 0x01: // device
+	  case 0x02: // configuration
+		list = &usb_device_descriptor_list[(wValue >> 8) - 1];
+		break;
+	  case 0x03: // string
+		if (n < sizeof(usb_string_descriptor_list) / sizeof(usb_descriptor_list_t)) {
+			list = &usb_string_descriptor_list[n];
+#ifdef OS_DESC_VERSION
+		} else if (n == 0xEE) {
+			list = &usb_os_string_descriptor_list;
+#endif
+		} else {
+			return NULL;
+		}
+		break;
+	  case 0x21: // HID
+	  case 0x22: // HID report
+		if (wIndex >= NUM_INTERFACE) return NULL;
+		list = &usb_hid_descriptor_list[wIndex][(wValue >> 8) - 0x21];
+		break;
+	  default:
+		return NULL;
+	}
+	if (list->addr == NULL || list->wValue != wValue || list->wIndex != wIndex) return NULL;
+	return list;
+}
+
 
 // **************************************************************
 //   Endpoint Configuration
@@ -2003,5 +2117,165 @@ const uint8_t usb_endpoint_config_table[NUM_ENDPOINTS] =
 };
 
 
+const usb_endpoint_quota_t usb_endpoint_quota_table[NUM_ENDPOINTS] =
+{
+#if (defined(ENDPOINT1_QUOTA) && NUM_ENDPOINTS >= 1)
+	USB_QUOTA_INIT(ENDPOINT1_QUOTA),
+#elif (NUM_ENDPOINTS >= 1)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT2_QUOTA) && NUM_ENDPOINTS >= 2)
+	USB_QUOTA_INIT(ENDPOINT2_QUOTA),
+#elif (NUM_ENDPOINTS >= 2)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT3_QUOTA) && NUM_ENDPOINTS >= 3)
+	USB_QUOTA_INIT(ENDPOINT3_QUOTA),
+#elif (NUM_ENDPOINTS >= 3)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT4_QUOTA) && NUM_ENDPOINTS >= 4)
+	USB_QUOTA_INIT(ENDPOINT4_QUOTA),
+#elif (NUM_ENDPOINTS >= 4)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT5_QUOTA) && NUM_ENDPOINTS >= 5)
+	USB_QUOTA_INIT(ENDPOINT5_QUOTA),
+#elif (NUM_ENDPOINTS >= 5)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT6_QUOTA) && NUM_ENDPOINTS >= 6)
+	USB_QUOTA_INIT(ENDPOINT6_QUOTA),
+#elif (NUM_ENDPOINTS >= 6)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT7_QUOTA) && NUM_ENDPOINTS >= 7)
+	USB_QUOTA_INIT(ENDPOINT7_QUOTA),
+#elif (NUM_ENDPOINTS >= 7)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT8_QUOTA) && NUM_ENDPOINTS >= 8)
+	USB_QUOTA_INIT(ENDPOINT8_QUOTA),
+#elif (NUM_ENDPOINTS >= 8)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT9_QUOTA) && NUM_ENDPOINTS >= 9)
+	USB_QUOTA_INIT(ENDPOINT9_QUOTA),
+#elif (NUM_ENDPOINTS >= 9)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT10_QUOTA) && NUM_ENDPOINTS >= 10)
+	USB_QUOTA_INIT(ENDPOINT10_QUOTA),
+#elif (NUM_ENDPOINTS >= 10)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT11_QUOTA) && NUM_ENDPOINTS >= 11)
+	USB_QUOTA_INIT(ENDPOINT11_QUOTA),
+#elif (NUM_ENDPOINTS >= 11)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT12_QUOTA) && NUM_ENDPOINTS >= 12)
+	USB_QUOTA_INIT(ENDPOINT12_QUOTA),
+#elif (NUM_ENDPOINTS >= 12)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT13_QUOTA) && NUM_ENDPOINTS >= 13)
+	USB_QUOTA_INIT(ENDPOINT13_QUOTA),
+#elif (NUM_ENDPOINTS >= 13)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT14_QUOTA) && NUM_ENDPOINTS >= 14)
+	USB_QUOTA_INIT(ENDPOINT14_QUOTA),
+#elif (NUM_ENDPOINTS >= 14)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+#if (defined(ENDPOINT15_QUOTA) && NUM_ENDPOINTS >= 15)
+	USB_QUOTA_INIT(ENDPOINT15_QUOTA),
+#elif (NUM_ENDPOINTS >= 15)
+	USB_QUOTA_INIT(USB_QUOTA_NONE),
+#endif
+};
+
+
+const uint8_t usb_endpoint_packet_size_table[NUM_ENDPOINTS] =
+{
+#if (defined(ENDPOINT1_PACKET_SIZE) && NUM_ENDPOINTS >= 1)
+	ENDPOINT1_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 1)
+	64,
+#endif
+#if (defined(ENDPOINT2_PACKET_SIZE) && NUM_ENDPOINTS >= 2)
+	ENDPOINT2_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 2)
+	64,
+#endif
+#if (defined(ENDPOINT3_PACKET_SIZE) && NUM_ENDPOINTS >= 3)
+	ENDPOINT3_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 3)
+	64,
+#endif
+#if (defined(ENDPOINT4_PACKET_SIZE) && NUM_ENDPOINTS >= 4)
+	ENDPOINT4_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 4)
+	64,
+#endif
+#if (defined(ENDPOINT5_PACKET_SIZE) && NUM_ENDPOINTS >= 5)
+	ENDPOINT5_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 5)
+	64,
+#endif
+#if (defined(ENDPOINT6_PACKET_SIZE) && NUM_ENDPOINTS >= 6)
+	ENDPOINT6_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 6)
+	64,
+#endif
+#if (defined(ENDPOINT7_PACKET_SIZE) && NUM_ENDPOINTS >= 7)
+	ENDPOINT7_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 7)
+	64,
+#endif
+#if (defined(ENDPOINT8_PACKET_SIZE) && NUM_ENDPOINTS >= 8)
+	ENDPOINT8_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 8)
+	64,
+#endif
+#if (defined(ENDPOINT9_PACKET_SIZE) && NUM_ENDPOINTS >= 9)
+	ENDPOINT9_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 9)
+	64,
+#endif
+#if (defined(ENDPOINT10_PACKET_SIZE) && NUM_ENDPOINTS >= 10)
+	ENDPOINT10_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 10)
+	64,
+#endif
+#if (defined(ENDPOINT11_PACKET_SIZE) && NUM_ENDPOINTS >= 11)
+	ENDPOINT11_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 11)
+	64,
+#endif
+#if (defined(ENDPOINT12_PACKET_SIZE) && NUM_ENDPOINTS >= 12)
+	ENDPOINT12_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 12)
+	64,
+#endif
+#if (defined(ENDPOINT13_PACKET_SIZE) && NUM_ENDPOINTS >= 13)
+	ENDPOINT13_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 13)
+	64,
+#endif
+#if (defined(ENDPOINT14_PACKET_SIZE) && NUM_ENDPOINTS >= 14)
+	ENDPOINT14_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 14)
+	64,
+#endif
+#if (defined(ENDPOINT15_PACKET_SIZE) && NUM_ENDPOINTS >= 15)
+	ENDPOINT15_PACKET_SIZE,
+#elif (NUM_ENDPOINTS >= 15)
+	64,
+#endif
+};
+
+
 #endif // NUM_ENDPOINTS
 #endif // F_CPU >= 20 MHz
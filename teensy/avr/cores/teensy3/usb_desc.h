@@ -46,6 +46,33 @@
 #define ENDPOINT_RECEIVE_ISOCHRONOUS	0x18
 #define ENDPOINT_TRANSMIT_ISOCHRONOUS	0x14
 
+// Optional packet buffer quota for an endpoint, ENDPOINTn_QUOTA.  The
+// reserve counts are buffers kept back for the endpoint, so others can
+// not use up the whole pool.  The max counts limit how many buffers the
+// endpoint may hold at once (received and not yet read, or queued and
+// not yet sent), 0 for no limit.  USB_QUOTA() is a list, which the
+// macros below take apart, so the table in usb_desc.c and the buffer
+// counts at the end of this file both come from the same numbers.
+#define USB_QUOTA(rx_reserve, rx_max, tx_reserve, tx_max) \
+	((rx_reserve), (rx_max), (tx_reserve), (tx_max))
+#define USB_QUOTA_NONE			USB_QUOTA(0, 0, 0, 0)
+#define USB_QUOTA_INIT_(rx_reserve, rx_max, tx_reserve, tx_max) \
+	{rx_reserve, rx_max, tx_reserve, tx_max}
+#define USB_QUOTA_INIT(quota)		USB_QUOTA_INIT_ quota
+#define USB_QUOTA_MAX_(rx_reserve, rx_max, tx_reserve, tx_max) \
+	(rx_max + tx_max)
+#define USB_QUOTA_MAX(quota)		USB_QUOTA_MAX_ quota
+
+// Optional ENDPOINTn_PACKET_SIZE, the largest packet an endpoint sends or
+// receives.  Endpoints no larger than USB_SMALL_PACKET_SIZE take their
+// buffers from a second pool of NUM_USB_SMALL_BUFFERS smaller packets,
+// which fit nearly twice as many in the same RAM.
+#define USB_SMALL_PACKET_SIZE		32
+
+// Optional USB_RX_PRIORITY, a list of receive endpoints, most important
+// first.  When the packet pool runs out, freed buffers go to starving
+// endpoints in this order, then to the rest in endpoint number order.
+
 /*
 Each group of #define lines below corresponds to one of the
 settings in the Tools > USB Type menu.  This file defines what
@@ -957,7 +984,8 @@ let me know?  http://forum.pjrc.com/forums/4-Suggestions-amp-Bug-Reports
     first "control" interface
 
 3. VENDOR_ID/PRODUCT_ID should not match any existing driver so that the device
-    is assigned the generic parent driver
+    is assigned the generic parent driver. The XInput types take them from XINPUT_VENDOR_ID and
+    XINPUT_PRODUCT_ID, which must be a pair you own; the build fails until both are defined.
 
 4. NUM_COMPAT_IDS should be the same as NUM_INTERFACE unless interfaces are grouped
     using an Interface Association Descriptor (IAD). In which case there should be
@@ -981,6 +1009,11 @@ let me know?  http://forum.pjrc.com/forums/4-Suggestions-amp-Bug-Reports
 9. OS_DESC_VERSION is used to enable OS descriptor features but also defines the version in case
     support for OS 2.0 Descriptors is added.
 
+10. NUM_USB_BUFFERS and NUM_USB_SMALL_BUFFERS are not set for XInput devices. They are counted
+    from the ENDPOINTn_QUOTA maximums and ENDPOINTn_PACKET_SIZE (see the end of this file), so
+    give every endpoint a quota with a maximum. Defining them anyway still works, but the build
+    fails if they are fewer than the quotas need.
+
 
 The steps to add a new composite device are mostly the same as before in regards to this file.
 
@@ -1011,16 +1044,15 @@ Computer\HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\usbflags\VID+PID+BC
   #define DEVICE_SUBCLASS	0x00
   #define DEVICE_PROTOCOL	0x00
   #define DEVICE_ATTRIBUTES 0xA0
-  #define VENDOR_ID
-  #define PRODUCT_ID
+  #define VENDOR_ID		XINPUT_VENDOR_ID
+  #define PRODUCT_ID		XINPUT_PRODUCT_ID
   #define VENDOR_CODE           0xA5
   #define MANUFACTURER_NAME	{'T','e','e','n','s','y','d','u','i','n','o'}
   #define MANUFACTURER_NAME_LEN	11
   #define PRODUCT_NAME		{'X','I','n','p','u','t',' ','C','o','n','t','r','o','l','l','e','r'}
   #define PRODUCT_NAME_LEN	    17
-  #define EP0_SIZE	            8
+  #define EP0_SIZE	            XINPUT_EP0_SIZE
   #define NUM_ENDPOINTS	        2
-  #define NUM_USB_BUFFERS	      24
   #define NUM_INTERFACE	        1
   #define NUM_COMPAT_IDS        1
   #define XINPUT_INTERFACE	    0
@@ -1030,7 +1062,11 @@ Computer\HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\usbflags\VID+PID+BC
   #define XINPUT_TX_SIZE        20
   #define ENDPOINT1_CONFIG ENDPOINT_TRANSMIT_ONLY
   #define ENDPOINT2_CONFIG ENDPOINT_RECEIVE_ONLY
-#endif // USB_XINPUT
+  #define ENDPOINT1_QUOTA  XINPUT_TX_QUOTA
+  #define ENDPOINT2_QUOTA  XINPUT_RX_QUOTA
+  #define ENDPOINT1_PACKET_SIZE XINPUT_TX_SIZE
+  #define ENDPOINT2_PACKET_SIZE XINPUT_RX_SIZE
+  #define USB_RX_PRIORITY  {XINPUT_RX_ENDPOINT}
 
 #elif defined(USB_XINPUT_KEYBOARD_MOUSE)
   #define BCD_USB 0x0200
@@ -1039,8 +1075,8 @@ Computer\HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\usbflags\VID+PID+BC
   #define DEVICE_SUBCLASS 0x00
   #define DEVICE_PROTOCOL 0x00
   #define DEVICE_ATTRIBUTES 0xA0
-  #define VENDOR_ID
-  #define PRODUCT_ID
+  #define VENDOR_ID             XINPUT_VENDOR_ID
+  #define PRODUCT_ID            XINPUT_PRODUCT_ID
   #define VENDOR_CODE           0xA5
   #define MANUFACTURER_NAME {'T','e','e','n','s','y','d','u','i','n','o'}
   #define MANUFACTURER_NAME_LEN 11
@@ -1048,7 +1084,6 @@ Computer\HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\usbflags\VID+PID+BC
   #define PRODUCT_NAME_LEN 10
   #define EP0_SIZE              64
   #define NUM_ENDPOINTS         4
-  #define NUM_USB_BUFFERS       24
   #define NUM_INTERFACE         3
   #define NUM_COMPAT_IDS        3
   #define XINPUT_INTERFACE      0
@@ -1068,17 +1103,325 @@ Computer\HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\usbflags\VID+PID+BC
   #define ENDPOINT2_CONFIG ENDPOINT_RECEIVE_ONLY
   #define ENDPOINT3_CONFIG ENDPOINT_TRANSMIT_ONLY
   #define ENDPOINT4_CONFIG ENDPOINT_TRANSMIT_ONLY
-#endif // USB_XINPUT_KEYBOARD_MOUSE
+  #define ENDPOINT1_QUOTA  XINPUT_TX_QUOTA
+  #define ENDPOINT2_QUOTA  XINPUT_RX_QUOTA
+  #define USB_CLASS_BUFFERS     11 // keyboard 4 + 2, mouse 3 + 2, see below
+  #define ENDPOINT1_PACKET_SIZE XINPUT_TX_SIZE
+  #define ENDPOINT2_PACKET_SIZE XINPUT_RX_SIZE
+  #define USB_RX_PRIORITY  {XINPUT_RX_ENDPOINT}
+
+#elif defined(USB_XINPUT_QUAD)
+  #define BCD_USB 0x0200
+  #define OS_DESC_VERSION 0x0100
+  #define DEVICE_CLASS 0x00
+  #define DEVICE_SUBCLASS 0x00
+  #define DEVICE_PROTOCOL 0x00
+  #define DEVICE_ATTRIBUTES 0xA0
+  #define VENDOR_ID             XINPUT_VENDOR_ID
+  #define PRODUCT_ID            XINPUT_PRODUCT_ID
+  #define VENDOR_CODE           0xA5
+  #define MANUFACTURER_NAME {'T','e','e','n','s','y','d','u','i','n','o'}
+  #define MANUFACTURER_NAME_LEN 11
+  #define PRODUCT_NAME {'X','I','n','p','u','t',' ','x','4'}
+  #define PRODUCT_NAME_LEN 9
+  #define EP0_SIZE              64
+  #define NUM_ENDPOINTS         8
+  #define NUM_INTERFACE         4
+  #define NUM_COMPAT_IDS        4
+  #define XINPUT_COUNT          4 // controller n: interface n, endpoints 2n+1 and 2n+2
+  #define XINPUT_TX_QUOTA       USB_QUOTA(0, 0, 1, 2) // one report per BDT bank
+  #define XINPUT_RX_QUOTA       USB_QUOTA(1, 2, 0, 0)
+  #define XINPUT_INTERFACE      0
+  #define XINPUT_RX_ENDPOINT    2
+  #define XINPUT_RX_SIZE        8
+  #define XINPUT_TX_ENDPOINT    1
+  #define XINPUT_TX_SIZE        20
+  #define ENDPOINT1_CONFIG ENDPOINT_TRANSMIT_ONLY
+  #define ENDPOINT2_CONFIG ENDPOINT_RECEIVE_ONLY
+  #define ENDPOINT3_CONFIG ENDPOINT_TRANSMIT_ONLY
+  #define ENDPOINT4_CONFIG ENDPOINT_RECEIVE_ONLY
+  #define ENDPOINT5_CONFIG ENDPOINT_TRANSMIT_ONLY
+  #define ENDPOINT6_CONFIG ENDPOINT_RECEIVE_ONLY
+  #define ENDPOINT7_CONFIG ENDPOINT_TRANSMIT_ONLY
+  #define ENDPOINT8_CONFIG ENDPOINT_RECEIVE_ONLY
+  #define ENDPOINT1_QUOTA  XINPUT_TX_QUOTA
+  #define ENDPOINT2_QUOTA  XINPUT_RX_QUOTA
+  #define ENDPOINT3_QUOTA  XINPUT_TX_QUOTA
+  #define ENDPOINT4_QUOTA  XINPUT_RX_QUOTA
+  #define ENDPOINT5_QUOTA  XINPUT_TX_QUOTA
+  #define ENDPOINT6_QUOTA  XINPUT_RX_QUOTA
+  #define ENDPOINT7_QUOTA  XINPUT_TX_QUOTA
+  #define ENDPOINT8_QUOTA  XINPUT_RX_QUOTA
+  #define ENDPOINT1_PACKET_SIZE XINPUT_TX_SIZE
+  #define ENDPOINT2_PACKET_SIZE XINPUT_RX_SIZE
+  #define ENDPOINT3_PACKET_SIZE XINPUT_TX_SIZE
+  #define ENDPOINT4_PACKET_SIZE XINPUT_RX_SIZE
+  #define ENDPOINT5_PACKET_SIZE XINPUT_TX_SIZE
+  #define ENDPOINT6_PACKET_SIZE XINPUT_RX_SIZE
+  #define ENDPOINT7_PACKET_SIZE XINPUT_TX_SIZE
+  #define ENDPOINT8_PACKET_SIZE XINPUT_RX_SIZE
+  #define USB_RX_PRIORITY  {2, 4, 6, 8}
 
 #elif defined(USB_XINPUT_SERIAL)
 
-#endif // USB_XINPUT_SERIAL
 
 #elif defined(USB_XINPUT_DIRECTINPUT)
 
-#endif // USB_XINPUT_DIRECTINPUT
   
 
+#endif
+
+// Optional features.  All are off by default.  Uncomment a line
+// here, or add it to the USB Type above, to enable it.
+//#define USB_STATS		// packet, error and buffer counters, see usb_stats.h
+#ifndef USB_SOF_HANDLERS
+#define USB_SOF_HANDLERS	4	// start of frame handler slots, see usb_dev.h
+#endif
+#ifdef XINPUT_INTERFACE
+// No VID:PID is assigned to the XInput types, see note 3 above
+//#define XINPUT_VENDOR_ID	0x0000
+//#define XINPUT_PRODUCT_ID	0x0000
+#if !defined(XINPUT_VENDOR_ID) || !defined(XINPUT_PRODUCT_ID)
+#error "Define XINPUT_VENDOR_ID and XINPUT_PRODUCT_ID as a VID:PID you own (see usb_desc.h)"
+#endif
+//#define XINPUT_TX_ZEROCOPY	// send reports from 2 static buffers, not the packet pool
+//#define XINPUT_TX_MAILBOX	// newer reports replace unsent ones (uses XINPUT_TX_ZEROCOPY)
+//#define XINPUT_LATENCY_STATS	// histograms of report latency, see usb_xinput.h
+//#define XINPUT_RX_PARSE	// decode rumble and LED packets in the interrupt
+#if defined(XINPUT_TX_MAILBOX) && !defined(XINPUT_TX_ZEROCOPY)
+#define XINPUT_TX_ZEROCOPY
+#endif
+#define XINPUT_RX_BUFFER_SIZE	32	// wMaxPacketSize of XINPUT_RX_ENDPOINT
+// USB_XINPUT endpoint 0 packet size.  A wired Xbox 360 controller uses
+// 8, but 64 moves the long descriptors (security string, OS and
+// configuration descriptors) in an eighth of the control transactions
+#ifndef XINPUT_EP0_SIZE
+#define XINPUT_EP0_SIZE		64
+#endif
+// Each controller reserves 1 transmit and 2 receive buffers, and holds
+// at most 3 reports in flight and 4 unread packets, unless the USB type
+// sets its own
+#ifndef XINPUT_TX_QUOTA
+#define XINPUT_TX_QUOTA		USB_QUOTA(0, 0, 1, 3)
+#endif
+#ifndef XINPUT_RX_QUOTA
+#define XINPUT_RX_QUOTA		USB_QUOTA(2, 4, 0, 0)
+#endif
+#ifndef XINPUT_COUNT
+#define XINPUT_COUNT		1
+#endif
+// Controllers after the first follow on with the next interfaces and
+// endpoint pairs
+#define XINPUT_TX_ENDPOINT_N(n)	(XINPUT_TX_ENDPOINT + 2 * (n))
+#define XINPUT_RX_ENDPOINT_N(n)	(XINPUT_RX_ENDPOINT + 2 * (n))
+#if XINPUT_COUNT > 1 && (defined(XINPUT_TX_ZEROCOPY) || defined(XINPUT_RX_PARSE))
+#error "XINPUT_TX_ZEROCOPY, XINPUT_TX_MAILBOX and XINPUT_RX_PARSE support only one controller"
+#endif
+#endif
+
+// Packet buffers each pool needs: the sum of every endpoint's quota
+// maximums, in the pool its ENDPOINTn_PACKET_SIZE selects, less those
+// endpoints using static buffers instead, plus USB_SPARE_BUFFERS for
+// packets the sketch holds after reading.  Endpoints without a maximum
+// can't be counted.  NUM_USB_BUFFERS and NUM_USB_SMALL_BUFFERS default
+// to these, and usb_mem.c checks a USB type's own numbers aren't less.
+#ifndef USB_SPARE_BUFFERS
+#define USB_SPARE_BUFFERS	2
+#endif
+// Regular buffers for endpoints without a quota whose class code limits
+// itself.  usb_keyboard.c and usb_mouse.c call usb_malloc() only while
+// fewer than TX_PACKET_LIMIT (4 and 3) packets are queued, and the
+// hardware holds 2 more, so a USB type with both needs 11.
+#ifndef USB_CLASS_BUFFERS
+#define USB_CLASS_BUFFERS	0
+#endif
+#if defined(ENDPOINT1_QUOTA) && NUM_ENDPOINTS >= 1
+#define USB_EP1_BUFFERS	USB_QUOTA_MAX(ENDPOINT1_QUOTA)
+#else
+#define USB_EP1_BUFFERS	0
+#endif
+#if defined(ENDPOINT1_PACKET_SIZE) && ENDPOINT1_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP1_SMALL		1
+#else
+#define USB_EP1_SMALL		0
+#endif
+#if defined(ENDPOINT2_QUOTA) && NUM_ENDPOINTS >= 2
+#define USB_EP2_BUFFERS	USB_QUOTA_MAX(ENDPOINT2_QUOTA)
+#else
+#define USB_EP2_BUFFERS	0
+#endif
+#if defined(ENDPOINT2_PACKET_SIZE) && ENDPOINT2_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP2_SMALL		1
+#else
+#define USB_EP2_SMALL		0
+#endif
+#if defined(ENDPOINT3_QUOTA) && NUM_ENDPOINTS >= 3
+#define USB_EP3_BUFFERS	USB_QUOTA_MAX(ENDPOINT3_QUOTA)
+#else
+#define USB_EP3_BUFFERS	0
+#endif
+#if defined(ENDPOINT3_PACKET_SIZE) && ENDPOINT3_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP3_SMALL		1
+#else
+#define USB_EP3_SMALL		0
+#endif
+#if defined(ENDPOINT4_QUOTA) && NUM_ENDPOINTS >= 4
+#define USB_EP4_BUFFERS	USB_QUOTA_MAX(ENDPOINT4_QUOTA)
+#else
+#define USB_EP4_BUFFERS	0
+#endif
+#if defined(ENDPOINT4_PACKET_SIZE) && ENDPOINT4_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP4_SMALL		1
+#else
+#define USB_EP4_SMALL		0
+#endif
+#if defined(ENDPOINT5_QUOTA) && NUM_ENDPOINTS >= 5
+#define USB_EP5_BUFFERS	USB_QUOTA_MAX(ENDPOINT5_QUOTA)
+#else
+#define USB_EP5_BUFFERS	0
+#endif
+#if defined(ENDPOINT5_PACKET_SIZE) && ENDPOINT5_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP5_SMALL		1
+#else
+#define USB_EP5_SMALL		0
+#endif
+#if defined(ENDPOINT6_QUOTA) && NUM_ENDPOINTS >= 6
+#define USB_EP6_BUFFERS	USB_QUOTA_MAX(ENDPOINT6_QUOTA)
+#else
+#define USB_EP6_BUFFERS	0
+#endif
+#if defined(ENDPOINT6_PACKET_SIZE) && ENDPOINT6_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP6_SMALL		1
+#else
+#define USB_EP6_SMALL		0
+#endif
+#if defined(ENDPOINT7_QUOTA) && NUM_ENDPOINTS >= 7
+#define USB_EP7_BUFFERS	USB_QUOTA_MAX(ENDPOINT7_QUOTA)
+#else
+#define USB_EP7_BUFFERS	0
+#endif
+#if defined(ENDPOINT7_PACKET_SIZE) && ENDPOINT7_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP7_SMALL		1
+#else
+#define USB_EP7_SMALL		0
+#endif
+#if defined(ENDPOINT8_QUOTA) && NUM_ENDPOINTS >= 8
+#define USB_EP8_BUFFERS	USB_QUOTA_MAX(ENDPOINT8_QUOTA)
+#else
+#define USB_EP8_BUFFERS	0
+#endif
+#if defined(ENDPOINT8_PACKET_SIZE) && ENDPOINT8_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP8_SMALL		1
+#else
+#define USB_EP8_SMALL		0
+#endif
+#if defined(ENDPOINT9_QUOTA) && NUM_ENDPOINTS >= 9
+#define USB_EP9_BUFFERS	USB_QUOTA_MAX(ENDPOINT9_QUOTA)
+#else
+#define USB_EP9_BUFFERS	0
+#endif
+#if defined(ENDPOINT9_PACKET_SIZE) && ENDPOINT9_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP9_SMALL		1
+#else
+#define USB_EP9_SMALL		0
+#endif
+#if defined(ENDPOINT10_QUOTA) && NUM_ENDPOINTS >= 10
+#define USB_EP10_BUFFERS	USB_QUOTA_MAX(ENDPOINT10_QUOTA)
+#else
+#define USB_EP10_BUFFERS	0
+#endif
+#if defined(ENDPOINT10_PACKET_SIZE) && ENDPOINT10_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP10_SMALL		1
+#else
+#define USB_EP10_SMALL		0
+#endif
+#if defined(ENDPOINT11_QUOTA) && NUM_ENDPOINTS >= 11
+#define USB_EP11_BUFFERS	USB_QUOTA_MAX(ENDPOINT11_QUOTA)
+#else
+#define USB_EP11_BUFFERS	0
+#endif
+#if defined(ENDPOINT11_PACKET_SIZE) && ENDPOINT11_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP11_SMALL		1
+#else
+#define USB_EP11_SMALL		0
+#endif
+#if defined(ENDPOINT12_QUOTA) && NUM_ENDPOINTS >= 12
+#define USB_EP12_BUFFERS	USB_QUOTA_MAX(ENDPOINT12_QUOTA)
+#else
+#define USB_EP12_BUFFERS	0
+#endif
+#if defined(ENDPOINT12_PACKET_SIZE) && ENDPOINT12_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP12_SMALL		1
+#else
+#define USB_EP12_SMALL		0
+#endif
+#if defined(ENDPOINT13_QUOTA) && NUM_ENDPOINTS >= 13
+#define USB_EP13_BUFFERS	USB_QUOTA_MAX(ENDPOINT13_QUOTA)
+#else
+#define USB_EP13_BUFFERS	0
+#endif
+#if defined(ENDPOINT13_PACKET_SIZE) && ENDPOINT13_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP13_SMALL		1
+#else
+#define USB_EP13_SMALL		0
+#endif
+#if defined(ENDPOINT14_QUOTA) && NUM_ENDPOINTS >= 14
+#define USB_EP14_BUFFERS	USB_QUOTA_MAX(ENDPOINT14_QUOTA)
+#else
+#define USB_EP14_BUFFERS	0
+#endif
+#if defined(ENDPOINT14_PACKET_SIZE) && ENDPOINT14_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP14_SMALL		1
+#else
+#define USB_EP14_SMALL		0
+#endif
+#if defined(ENDPOINT15_QUOTA) && NUM_ENDPOINTS >= 15
+#define USB_EP15_BUFFERS	USB_QUOTA_MAX(ENDPOINT15_QUOTA)
+#else
+#define USB_EP15_BUFFERS	0
+#endif
+#if defined(ENDPOINT15_PACKET_SIZE) && ENDPOINT15_PACKET_SIZE <= USB_SMALL_PACKET_SIZE
+#define USB_EP15_SMALL		1
+#else
+#define USB_EP15_SMALL		0
+#endif
+#define USB_REGULAR_MAX_SUM	(USB_EP1_BUFFERS * !USB_EP1_SMALL + USB_EP2_BUFFERS * !USB_EP2_SMALL + USB_EP3_BUFFERS * !USB_EP3_SMALL \
+	+ USB_EP4_BUFFERS * !USB_EP4_SMALL + USB_EP5_BUFFERS * !USB_EP5_SMALL + USB_EP6_BUFFERS * !USB_EP6_SMALL \
+	+ USB_EP7_BUFFERS * !USB_EP7_SMALL + USB_EP8_BUFFERS * !USB_EP8_SMALL + USB_EP9_BUFFERS * !USB_EP9_SMALL \
+	+ USB_EP10_BUFFERS * !USB_EP10_SMALL + USB_EP11_BUFFERS * !USB_EP11_SMALL + USB_EP12_BUFFERS * !USB_EP12_SMALL \
+	+ USB_EP13_BUFFERS * !USB_EP13_SMALL + USB_EP14_BUFFERS * !USB_EP14_SMALL + USB_EP15_BUFFERS * !USB_EP15_SMALL)
+#define USB_SMALL_MAX_SUM	(USB_EP1_BUFFERS * USB_EP1_SMALL + USB_EP2_BUFFERS * USB_EP2_SMALL + USB_EP3_BUFFERS * USB_EP3_SMALL \
+	+ USB_EP4_BUFFERS * USB_EP4_SMALL + USB_EP5_BUFFERS * USB_EP5_SMALL + USB_EP6_BUFFERS * USB_EP6_SMALL \
+	+ USB_EP7_BUFFERS * USB_EP7_SMALL + USB_EP8_BUFFERS * USB_EP8_SMALL + USB_EP9_BUFFERS * USB_EP9_SMALL \
+	+ USB_EP10_BUFFERS * USB_EP10_SMALL + USB_EP11_BUFFERS * USB_EP11_SMALL + USB_EP12_BUFFERS * USB_EP12_SMALL \
+	+ USB_EP13_BUFFERS * USB_EP13_SMALL + USB_EP14_BUFFERS * USB_EP14_SMALL + USB_EP15_BUFFERS * USB_EP15_SMALL)
+#if defined(XINPUT_INTERFACE) && defined(XINPUT_RX_PARSE)
+#define USB_XINPUT_STATIC_RX	(USB_QUOTA_MAX(XINPUT_RX_QUOTA) * XINPUT_COUNT)
+#else
+#define USB_XINPUT_STATIC_RX	0
+#endif
+#if defined(XINPUT_INTERFACE) && defined(XINPUT_TX_ZEROCOPY)
+#define USB_XINPUT_STATIC_TX	(USB_QUOTA_MAX(XINPUT_TX_QUOTA) * XINPUT_COUNT)
+#else
+#define USB_XINPUT_STATIC_TX	0
+#endif
+// the XInput endpoints are all in the small pool
+#define USB_SMALL_BUFFERS_USED	(USB_SMALL_MAX_SUM - USB_XINPUT_STATIC_RX - USB_XINPUT_STATIC_TX)
+#if USB_REGULAR_MAX_SUM + USB_CLASS_BUFFERS > 0 || USB_SMALL_BUFFERS_USED <= 0
+#define USB_BUFFERS_NEEDED	(USB_REGULAR_MAX_SUM + USB_CLASS_BUFFERS + USB_SPARE_BUFFERS)
+#else
+#define USB_BUFFERS_NEEDED	0
+#endif
+#if USB_SMALL_BUFFERS_USED > 0
+#define USB_SMALL_BUFFERS_NEEDED (USB_SMALL_BUFFERS_USED + USB_SPARE_BUFFERS)
+#else
+#define USB_SMALL_BUFFERS_NEEDED 0
+#endif
+#ifndef NUM_USB_BUFFERS
+#define NUM_USB_BUFFERS		USB_BUFFERS_NEEDED
+#endif
+#ifndef NUM_USB_SMALL_BUFFERS
+#define NUM_USB_SMALL_BUFFERS	USB_SMALL_BUFFERS_NEEDED
 #endif
 
 #ifdef USB_DESC_LIST_DEFINE
@@ -1093,7 +1436,29 @@ typedef struct {
 	uint16_t	length;
 } usb_descriptor_list_t;
 
-extern const usb_descriptor_list_t usb_descriptor_list[];
+const usb_descriptor_list_t * usb_descriptor_lookup(uint16_t wValue, uint16_t wIndex);
+
+// String descriptor stored as 8-bit (Latin-1) characters, half the
+// size of UTF-16.  usb_dev.c widens it as it sends each packet, with
+// bDescriptorType 3.  bLength is the length the host sees, 2 + 2 *
+// characters.  Names with characters beyond 0xFF need the UTF-16
+// usb_string_descriptor_struct of usb_names.h.
+#define USB_STRING8_TYPE	0x83
+struct usb_string8_descriptor_struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;	// USB_STRING8_TYPE
+	uint8_t str[];
+};
+
+typedef struct {
+	uint8_t		rx_reserve;
+	uint8_t		rx_max;
+	uint8_t		tx_reserve;
+	uint8_t		tx_max;
+} usb_endpoint_quota_t;
+
+extern const usb_endpoint_quota_t usb_endpoint_quota_table[NUM_ENDPOINTS];
+extern const uint8_t usb_endpoint_packet_size_table[NUM_ENDPOINTS];
 #endif // NUM_ENDPOINTS
 #endif // USB_DESC_LIST_DEFINE
 
@@ -41,9 +41,10 @@
 #if F_CPU >= 20000000 && defined(NUM_ENDPOINTS)
 
 #include "kinetis.h"
+#include "core_pins.h" // for micros
 //#include "HardwareSerial.h"
 #include "usb_mem.h"
-#include <string.h> // for memset
+#include <string.h> // for memset, memcpy
 
 // This code has a known bug with compiled with -O2 optimization on gcc 5.4.1
 // https://forum.pjrc.com/threads/53574-Teensyduino-1-43-Beta-2?p=186177&viewfull=1#post186177
@@ -63,19 +64,245 @@ typedef struct {
 __attribute__ ((section(".usbdescriptortable"), used))
 static bdt_t table[(NUM_ENDPOINTS+1)*4];
 
-static usb_packet_t *rx_first[NUM_ENDPOINTS];
-static usb_packet_t *rx_last[NUM_ENDPOINTS];
-static usb_packet_t *tx_first[NUM_ENDPOINTS];
-static usb_packet_t *tx_last[NUM_ENDPOINTS];
-uint16_t usb_rx_byte_count_data[NUM_ENDPOINTS];
+usb_endpoint_state_t usb_endpoint_state[NUM_ENDPOINTS];
+
+// tx_state: bit 0 is the bank (EVEN or ODD) for the next packet, as
+// the USB hardware alternates them, and the bits above count the
+// banks armed, 0 to 2.  Isochronous endpoints only use bit 0.
+#define TX_BANK(state)		((state) & 1)
+#define TX_ARMED(state)		((state) >> 1)
+#define TX_ARM(state)		(((state) ^ 1) + 2)
+#define TX_DONE(state)		((state) - 2)
+
+// Transmit endpoints with packets newly queued by usb_tx(), which
+// usb_isr() arms.  Only usb_isr() changes tx_state for pool packets.
+static volatile uint32_t tx_wake;
+
+// Packet buffer numbers count the small pool after the regular one,
+// as laid out in usb_buffer_memory (see usb_mem.c)
+extern unsigned char usb_buffer_memory[];
+#define SMALL_POOL (usb_buffer_memory + NUM_USB_BUFFERS * sizeof(usb_packet_t))
+#if NUM_USB_SMALL_BUFFERS > 0
+#define packet_number(p) (((uint8_t *)(p) < SMALL_POOL) ? \
+	((uint8_t *)(p) - usb_buffer_memory) / sizeof(usb_packet_t) : \
+	NUM_USB_BUFFERS + ((uint8_t *)(p) - SMALL_POOL) / USB_SMALL_PACKET_BYTES)
+#define packet_at(n) ((usb_packet_t *)(((n) < NUM_USB_BUFFERS) ? \
+	usb_buffer_memory + (n) * sizeof(usb_packet_t) : \
+	SMALL_POOL + ((n) - NUM_USB_BUFFERS) * USB_SMALL_PACKET_BYTES))
+#define packet_small(p) ((uint8_t *)(p) >= SMALL_POOL)
+#define endpoint_small(endpoint) \
+	(usb_endpoint_packet_size_table[endpoint] <= USB_SMALL_PACKET_SIZE)
+#else
+#define packet_number(p) (((uint8_t *)(p) - usb_buffer_memory) / sizeof(usb_packet_t))
+#define packet_at(n) ((usb_packet_t *)(usb_buffer_memory + (n) * sizeof(usb_packet_t)))
+#define packet_small(p) 0
+#define endpoint_small(endpoint) 0
+#endif
+#define rx_size(endpoint) (endpoint_small(endpoint) ? USB_SMALL_PACKET_SIZE : 64)
+#define reserved_count(endpoint) (endpoint_small(endpoint) ? \
+	&usb_small_buffers_reserved : &usb_buffers_reserved)
+
+// Function adds a packet to a queue.  Transmit queues have several
+// producers, usb_tx() from the sketch and from callbacks in either USB
+// interrupt, so the slot is written and "in" published with the USB
+// interrupts masked, lest another push take the same slot.
+static void queue_push(usb_queue_t *q, usb_packet_t *packet)
+{
+	uint32_t mask, in, n = packet_number(packet);
+
+	mask = usb_irq_mask();
+	in = q->in;
+	q->packet[(in >> 16) & (USB_QUEUE_DEPTH - 1)] = n;
+	q->in = (((in >> 16) + 1) << 16 & 0xFF0000) | ((in + packet->len) & 0xFFFF);
+	usb_irq_restore(mask);
+}
+
+// Function removes the oldest packet from a queue, or returns NULL
+static usb_packet_t * queue_pop(usb_queue_t *q)
+{
+	uint32_t out = q->out;
+	usb_packet_t *packet;
+
+	do {
+		if (((q->in ^ out) & 0xFF0000) == 0) return NULL;
+		packet = packet_at(q->packet[(out >> 16) & (USB_QUEUE_DEPTH - 1)]);
+	} while (!usb_atomic_cas(&q->out, out, (((out >> 16) + 1) << 16 & 0xFF0000)
+		| ((out + packet->len) & 0xFFFF)));
+	return packet;
+}
+
+// Packet buffers each endpoint holds, for usb_endpoint_quota_table.
+// While an endpoint holds fewer than its reserve, the difference is
+// counted in usb_buffers_reserved, or usb_small_buffers_reserved for
+// endpoints using the small pool, which usb_malloc() leaves alone.
+// usb_isr() changes these directly, other code with usb_atomic_add().
+// They are rx_held and tx_held in usb_endpoint_state.
+
+// Receive endpoints which have a BDT left without a buffer, and those
+// holding their rx_max, one bit each.  Bits are in priority order, the
+// most important endpoint in bit 31, so usb_rx_memory() finds the one
+// to feed with a single count leading zeros.  The order comes from
+// USB_RX_PRIORITY in usb_desc.h, then the rest by endpoint number.
+static uint32_t rx_starving;
+static volatile uint32_t rx_at_max;
+static uint32_t rx_small;	// endpoints using the small pool
+static uint8_t rx_by_rank[NUM_ENDPOINTS];
+#define RX_BIT(endpoint) (0x80000000 >> usb_endpoint_state[endpoint].rx_rank)
+
+static void rx_priority_init(void)
+{
+#ifdef USB_RX_PRIORITY
+	static const uint8_t priority[] = USB_RX_PRIORITY;
+#endif
+	uint8_t ranked[NUM_ENDPOINTS];
+	uint32_t i, rank = 0;
+
+	memset(ranked, 0, sizeof(ranked));
+#ifdef USB_RX_PRIORITY
+	for (i=0; i < sizeof(priority); i++) {
+		uint32_t endpoint = priority[i] - 1;
+		if (endpoint >= NUM_ENDPOINTS || ranked[endpoint]) continue;
+		ranked[endpoint] = 1;
+		usb_endpoint_state[endpoint].rx_rank = rank;
+		rx_by_rank[rank++] = endpoint;
+	}
+#endif
+	for (i=0; i < NUM_ENDPOINTS; i++) {
+		if (ranked[i]) continue;
+		usb_endpoint_state[i].rx_rank = rank;
+		rx_by_rank[rank++] = i;
+	}
+	for (i=0; i < NUM_ENDPOINTS; i++) {
+		if (endpoint_small(i)) rx_small |= RX_BIT(i);
+	}
+}
+
+static inline void rx_hold(uint32_t endpoint)
+{
+	const usb_endpoint_quota_t *q = &usb_endpoint_quota_table[endpoint];
+
+	if (usb_endpoint_state[endpoint].rx_held++ < q->rx_reserve) (*reserved_count(endpoint))--;
+	if (usb_endpoint_state[endpoint].rx_held == q->rx_max) rx_at_max |= RX_BIT(endpoint);
+}
+
+// Called by usb_rx() without masking interrupts, so each count changes
+// in one atomic step.  A packet still queued when SET_CONFIGURATION
+// clears the counts is not released twice, as the held count is zero.
+static inline void rx_unhold(uint32_t endpoint)
+{
+	uint8_t held = usb_endpoint_state[endpoint].rx_held;
+
+	do {
+		if (held == 0) return;
+	} while (!usb_atomic_cas(&usb_endpoint_state[endpoint].rx_held, held, held - 1));
+	if (held - 1 < usb_endpoint_quota_table[endpoint].rx_reserve)
+		usb_atomic_add(reserved_count(endpoint), 1);
+	usb_atomic_and(&rx_at_max, ~RX_BIT(endpoint));
+}
+
+static inline void tx_hold(uint32_t endpoint)
+{
+	uint8_t held = usb_endpoint_state[endpoint].tx_held;
+
+	while (!usb_atomic_cas(&usb_endpoint_state[endpoint].tx_held, held, held + 1)) ;
+	if (held < usb_endpoint_quota_table[endpoint].tx_reserve)
+		usb_atomic_add(reserved_count(endpoint), -1);
+}
+
+static inline void tx_unhold(uint32_t endpoint)
+{
+	if (usb_endpoint_state[endpoint].tx_held == 0) return;
+	if (--usb_endpoint_state[endpoint].tx_held < usb_endpoint_quota_table[endpoint].tx_reserve)
+		(*reserved_count(endpoint))++;
+}
+
+// Function returns true if the endpoint holds its maximum of received packets
+static inline int rx_full(uint32_t endpoint)
+{
+	return rx_at_max & RX_BIT(endpoint);
+}
+
+// Function allocates a receive buffer for an endpoint, within its quota
+static usb_packet_t * rx_alloc(uint32_t endpoint)
+{
+	usb_packet_t *p;
+
+	if (rx_full(endpoint)) return NULL;
+	if (usb_endpoint_state[endpoint].rx_held < usb_endpoint_quota_table[endpoint].rx_reserve) {
+		p = usb_malloc_reserved(endpoint_small(endpoint));
+	} else if (endpoint_small(endpoint)) {
+		p = usb_malloc_small();
+	} else {
+		p = usb_malloc();
+	}
+	if (p) rx_hold(endpoint);
+	return p;
+}
+
+// Function clears the held counts and reserves every endpoint's minimum,
+// after all packets have been freed at SET_CONFIGURATION
+static void quota_reset(void)
+{
+	const usb_endpoint_quota_t *q = usb_endpoint_quota_table;
+	uint32_t i, n, reserved = 0, small_reserved = 0;
+
+	rx_starving = 0;
+	rx_at_max = 0;
+	for (i=0; i < NUM_ENDPOINTS; i++, q++) {
+		usb_endpoint_state[i].rx_held = 0;
+		usb_endpoint_state[i].tx_held = 0;
+#ifdef XINPUT_RX_PARSE
+		// static buffers, nothing to reserve
+		if (i == XINPUT_RX_ENDPOINT-1) usb_endpoint_state[i].rx_held = q->rx_reserve;
+#endif
+#ifdef XINPUT_TX_ZEROCOPY
+		if (i == XINPUT_TX_ENDPOINT-1) usb_endpoint_state[i].tx_held = q->tx_reserve;
+#endif
+		n = q->rx_reserve - usb_endpoint_state[i].rx_held + q->tx_reserve - usb_endpoint_state[i].tx_held;
+		if (endpoint_small(i)) {
+			small_reserved += n;
+		} else {
+			reserved += n;
+		}
+	}
+	usb_buffers_reserved = reserved;
+	usb_small_buffers_reserved = small_reserved;
+}
+
+// Function allocates a packet to transmit on an endpoint.  It may use
+// the endpoint's reserved buffers, and returns NULL if the endpoint
+// already holds its maximum.  Sending with usb_tx() counts the packet
+// against the endpoint until the host has read it.
+usb_packet_t * usb_malloc_tx(uint32_t endpoint)
+{
+	const usb_endpoint_quota_t *q;
+
+	endpoint--;
+	if (endpoint >= NUM_ENDPOINTS) return NULL;
+	q = &usb_endpoint_quota_table[endpoint];
+	if (q->tx_max && usb_endpoint_state[endpoint].tx_held >= q->tx_max) return NULL;
+	if (usb_endpoint_state[endpoint].tx_held < q->tx_reserve) {
+		return usb_malloc_reserved(endpoint_small(endpoint));
+	}
+	if (endpoint_small(endpoint)) return usb_malloc_small();
+	return usb_malloc();
+}
+
+#ifdef XINPUT_LATENCY_STATS
+// Cycle count when each XInput transmit bank was armed, for the
+// latency histograms in usb_xinput.c
+volatile uint32_t usb_xinput_arm_cycles[2];
+#define XINPUT_ARM_STAMP_AT(endpoint, b, cycles) do { \
+	if ((endpoint) == XINPUT_TX_ENDPOINT-1) \
+		usb_xinput_arm_cycles[((uint32_t)(b) & 8) ? 1 : 0] = (cycles); \
+} while (0)
+#define XINPUT_ARM_STAMP(endpoint, b) \
+	XINPUT_ARM_STAMP_AT(endpoint, b, usb_cycle_count())
+#else
+#define XINPUT_ARM_STAMP_AT(endpoint, b, cycles)
+#define XINPUT_ARM_STAMP(endpoint, b)
+#endif
 
-static uint8_t tx_state[NUM_ENDPOINTS];
-#define TX_STATE_BOTH_FREE_EVEN_FIRST	0
-#define TX_STATE_BOTH_FREE_ODD_FIRST	1
-#define TX_STATE_EVEN_FREE		2
-#define TX_STATE_ODD_FREE		3
-#define TX_STATE_NONE_FREE_EVEN_FIRST	4
-#define TX_STATE_NONE_FREE_ODD_FIRST	5
 
 #define BDT_OWN		0x80
 #define BDT_DATA1	0x40
@@ -140,11 +367,43 @@ static const uint8_t *ep0_tx_ptr = NULL;
 static uint16_t ep0_tx_len;
 static uint8_t ep0_tx_bdt_bank = 0;
 static uint8_t ep0_tx_data_toggle = 0;
+static const uint8_t *ep0_tx_string8 = NULL;
+static uint8_t ep0_tx_wide[2][EP0_SIZE] __attribute__ ((aligned (4)));
+#ifdef USB_DEFERRED_IRQ
+// Set by usb_isr() when a SETUP arrives, until usb_control() handles it,
+// so tokens of the previous transfer still queued cannot arm a reply.
+static volatile uint8_t ep0_tx_setup_pending = 0;
+#endif
 uint8_t usb_rx_memory_needed = 0;
 
+#ifdef USB_STATS
+usb_stats_t usb_stats;
+usb_boot_times_t usb_boot_times;
+#define USB_STATS_INC(counter) (usb_stats.counter++)
+#define USB_BOOT_TIME(phase) do { \
+	if (!usb_boot_times.phase) usb_boot_times.phase = micros(); \
+} while (0)
+#else
+#define USB_STATS_INC(counter)
+#define USB_BOOT_TIME(phase)
+#endif
+
+// Function leaves a receive BDT without a buffer, until usb_rx_memory()
+static inline void rx_starve(uint32_t endpoint, bdt_t *b)
+{
+	b->desc = 0;
+	usb_rx_memory_needed++;
+	rx_starving |= RX_BIT(endpoint);
+	USB_STATS_INC(rx_starved);
+}
+
 volatile uint8_t usb_configuration = 0;
 volatile uint8_t usb_reboot_timer = 0;
 
+// Cycle count and frame number captured at each start of frame
+volatile uint32_t usb_sof_cycles = 0;
+volatile uint16_t usb_sof_frame = 0;
+
 
 static void endpoint0_stall(void)
 {
@@ -161,6 +420,9 @@ static void endpoint0_transmit(const void *data, uint32_t len)
 	serial_phex16(len);
 	serial_print(ep0_tx_bdt_bank ? ", odd" : ", even");
 	serial_print(ep0_tx_data_toggle ? ", d1\n" : ", d0\n");
+#endif
+#ifdef USB_DEFERRED_IRQ
+	if (ep0_tx_setup_pending) return;
 #endif
 	table[index(0, TX, ep0_tx_bdt_bank)].addr = (void *)data;
 	table[index(0, TX, ep0_tx_bdt_bank)].desc = BDT_DESC(len, ep0_tx_data_toggle);
@@ -168,6 +430,28 @@ static void endpoint0_transmit(const void *data, uint32_t len)
 	ep0_tx_bdt_bank ^= 1;
 }
 
+// Function sends the next part of the data stage.  A USB_STRING8_TYPE
+// string descriptor (see usb_desc.h) is widened to UTF-16 in the buffer
+// of the bank being armed, and data then counts bytes of the widened
+// descriptor from ep0_tx_string8.
+static void endpoint0_transmit_data(const uint8_t *data, uint32_t len)
+{
+	const uint8_t *src = ep0_tx_string8;
+	uint8_t *buf;
+	uint32_t i, n;
+
+	if (src) {
+		n = (uint32_t)data - (uint32_t)src;
+		buf = ep0_tx_wide[ep0_tx_bdt_bank];
+		for (i=0; i < len; i++, n++) {
+			if (n < 2) buf[i] = n ? 3 : src[0];
+			else buf[i] = (n & 1) ? 0 : src[2 + ((n - 2) >> 1)];
+		}
+		data = buf;
+	}
+	endpoint0_transmit(data, len);
+}
+
 static uint8_t reply_buffer[8];
 
 static void usb_setup(void)
@@ -186,49 +470,38 @@ static void usb_setup(void)
 		break;
 	  case 0x0900: // SET_CONFIGURATION
 		//serial_print("configure\n");
+		USB_BOOT_TIME(configured);
+#ifdef USB_STATS
+		if (!usb_stats.enum_transactions) {
+			usb_stats.enum_transactions = usb_stats.rx_packets[0] + usb_stats.tx_packets[0];
+			usb_stats.enum_setups = usb_stats.control_setups;
+		}
+#endif
 		usb_configuration = setup.wValue;
 		reg = &USB0_ENDPT1;
 		cfg = usb_endpoint_config_table;
 		// clear all BDT entries, free any allocated memory...
 		for (i=4; i < (NUM_ENDPOINTS+1)*4; i++) {
+#ifdef XINPUT_TX_ZEROCOPY
+			// XInput reports are static buffers, not packets
+			if ((i & ~1) == index(XINPUT_TX_ENDPOINT, TX, EVEN)) continue;
+#endif
+#ifdef XINPUT_RX_PARSE
+			if ((i & ~1) == index(XINPUT_RX_ENDPOINT, RX, EVEN)) continue;
+#endif
 			if (table[i].desc & BDT_OWN) {
 				usb_free((usb_packet_t *)((uint8_t *)(table[i].addr) - 8));
 			}
 		}
 		// free all queued packets
 		for (i=0; i < NUM_ENDPOINTS; i++) {
-			usb_packet_t *p, *n;
-			p = rx_first[i];
-			while (p) {
-				n = p->next;
-				usb_free(p);
-				p = n;
-			}
-			rx_first[i] = NULL;
-			rx_last[i] = NULL;
-			p = tx_first[i];
-			while (p) {
-				n = p->next;
-				usb_free(p);
-				p = n;
-			}
-			tx_first[i] = NULL;
-			tx_last[i] = NULL;
-			usb_rx_byte_count_data[i] = 0;
-			switch (tx_state[i]) {
-			  case TX_STATE_EVEN_FREE:
-			  case TX_STATE_NONE_FREE_EVEN_FIRST:
-				tx_state[i] = TX_STATE_BOTH_FREE_EVEN_FIRST;
-				break;
-			  case TX_STATE_ODD_FREE:
-			  case TX_STATE_NONE_FREE_ODD_FIRST:
-				tx_state[i] = TX_STATE_BOTH_FREE_ODD_FIRST;
-				break;
-			  default:
-				break;
-			}
+			usb_packet_t *p;
+			while ((p = queue_pop(&usb_endpoint_state[i].rx)) != NULL) usb_free(p);
+			while ((p = queue_pop(&usb_endpoint_state[i].tx)) != NULL) usb_free(p);
+			usb_endpoint_state[i].tx_state = TX_BANK(usb_endpoint_state[i].tx_state);
 		}
 		usb_rx_memory_needed = 0;
+		quota_reset();
 		for (i=1; i <= NUM_ENDPOINTS; i++) {
 			epconf = *cfg++;
 			*reg = epconf;
@@ -240,24 +513,30 @@ static void usb_setup(void)
 				table[index(i, RX, ODD)].addr = usb_audio_receive_buffer;
 				table[index(i, RX, ODD)].desc = (AUDIO_RX_SIZE<<16) | BDT_OWN;
 			} else
+#endif
+#ifdef XINPUT_RX_PARSE
+			if (i == XINPUT_RX_ENDPOINT) {
+				table[index(i, RX, EVEN)].addr = usb_xinput_rx_buffer[0];
+				table[index(i, RX, EVEN)].desc = BDT_DESC(XINPUT_RX_BUFFER_SIZE, 0);
+				table[index(i, RX, ODD)].addr = usb_xinput_rx_buffer[1];
+				table[index(i, RX, ODD)].desc = BDT_DESC(XINPUT_RX_BUFFER_SIZE, 1);
+			} else
 #endif
 			if (epconf & USB_ENDPT_EPRXEN) {
 				usb_packet_t *p;
-				p = usb_malloc();
+				p = rx_alloc(i - 1);
 				if (p) {
 					table[index(i, RX, EVEN)].addr = p->buf;
-					table[index(i, RX, EVEN)].desc = BDT_DESC(64, 0);
+					table[index(i, RX, EVEN)].desc = BDT_DESC(rx_size(i - 1), 0);
 				} else {
-					table[index(i, RX, EVEN)].desc = 0;
-					usb_rx_memory_needed++;
+					rx_starve(i - 1, &table[index(i, RX, EVEN)]);
 				}
-				p = usb_malloc();
+				p = rx_alloc(i - 1);
 				if (p) {
 					table[index(i, RX, ODD)].addr = p->buf;
-					table[index(i, RX, ODD)].desc = BDT_DESC(64, 1);
+					table[index(i, RX, ODD)].desc = BDT_DESC(rx_size(i - 1), 1);
 				} else {
-					table[index(i, RX, ODD)].desc = 0;
-					usb_rx_memory_needed++;
+					rx_starve(i - 1, &table[index(i, RX, ODD)]);
 				}
 			}
 			table[index(i, TX, EVEN)].desc = 0;
@@ -319,36 +598,23 @@ static void usb_setup(void)
 		//serial_print("desc:");
 		//serial_phex16(setup.wValue);
 		//serial_print("\n");
-		for (list = usb_descriptor_list; 1; list++) {
-			if (list->addr == NULL) break;
-			//if (setup.wValue == list->wValue &&
-			//(setup.wIndex == list->wIndex) || ((setup.wValue >> 8) == 3)) {
-			if (setup.wValue == list->wValue && setup.wIndex == list->wIndex) {
-				data = list->addr;
-				if ((setup.wValue >> 8) == 3) {
-					// for string descriptors, use the descriptor's
-					// length field, allowing runtime configured
-					// length.
-					datalen = *(list->addr);
-				} else {
-					datalen = list->length;
-				}
-#if 0
-				serial_print("Desc found, ");
-				serial_phex32((uint32_t)data);
-				serial_print(",");
-				serial_phex16(datalen);
-				serial_print(",");
-				serial_phex(data[0]);
-				serial_phex(data[1]);
-				serial_phex(data[2]);
-				serial_phex(data[3]);
-				serial_phex(data[4]);
-				serial_phex(data[5]);
-				serial_print("\n");
-#endif
-				goto send;
+		list = usb_descriptor_lookup(setup.wValue, setup.wIndex);
+		if (list) {
+			data = list->addr;
+			// string descriptors without a length use their own
+			// length field, allowing runtime configured length.
+			datalen = list->length ? list->length : *(list->addr);
+			if ((setup.wValue >> 8) == 3 && data[1] == USB_STRING8_TYPE) {
+				ep0_tx_string8 = data;
 			}
+#if 0
+			serial_print("Desc found, ");
+			serial_phex32((uint32_t)data);
+			serial_print(",");
+			serial_phex16(datalen);
+			serial_print("\n");
+#endif
+			goto send;
 		}
 		//serial_print("desc: not found\n");
 		endpoint0_stall();
@@ -420,13 +686,13 @@ static void usb_setup(void)
 			usb_audio_transmit_setting = setup.wValue;
 			if (usb_audio_transmit_setting > 0) {
 				bdt_t *b = &table[index(AUDIO_TX_ENDPOINT, TX, EVEN)];
-				uint8_t state = tx_state[AUDIO_TX_ENDPOINT-1];
+				uint8_t state = usb_endpoint_state[AUDIO_TX_ENDPOINT-1].tx_state;
 				if (state) b++;
 				if (!(b->desc & BDT_OWN)) {
 					memset(usb_audio_transmit_buffer, 0, 176);
 					b->addr = usb_audio_transmit_buffer;
 					b->desc = (176 << 16) | BDT_OWN;
-					tx_state[AUDIO_TX_ENDPOINT-1] = state ^ 1;
+					usb_endpoint_state[AUDIO_TX_ENDPOINT-1].tx_state = state ^ 1;
 				}
 			}
 		} else if (setup.wIndex == AUDIO_INTERFACE+2) {
@@ -537,14 +803,14 @@ static void usb_setup(void)
 	if (datalen > setup.wLength) datalen = setup.wLength;
 	size = datalen;
 	if (size > EP0_SIZE) size = EP0_SIZE;
-	endpoint0_transmit(data, size);
+	endpoint0_transmit_data(data, size);
 	data += size;
 	datalen -= size;
 	if (datalen == 0 && size < EP0_SIZE) return;
 
 	size = datalen;
 	if (size > EP0_SIZE) size = EP0_SIZE;
-	endpoint0_transmit(data, size);
+	endpoint0_transmit_data(data, size);
 	data += size;
 	datalen -= size;
 	if (datalen == 0 && size < EP0_SIZE) return;
@@ -596,6 +862,7 @@ static void usb_control(uint32_t stat)
 		// grab the 8 byte setup info
 		setup.word1 = *(uint32_t *)(buf);
 		setup.word2 = *(uint32_t *)(buf + 4);
+		USB_STATS_INC(control_setups);
 
 		// give the buffer back
 		b->desc = BDT_DESC(EP0_SIZE, DATA1);
@@ -604,6 +871,10 @@ static void usb_control(uint32_t stat)
 
 		// clear any leftover pending IN transactions
 		ep0_tx_ptr = NULL;
+		ep0_tx_string8 = NULL;
+#ifdef USB_DEFERRED_IRQ
+		ep0_tx_setup_pending = 0;
+#endif
 		if (ep0_tx_data_toggle) {
 		}
 		//if (table[index(0, TX, EVEN)].desc & 0x80) {
@@ -703,7 +974,7 @@ static void usb_control(uint32_t stat)
 		if (data) {
 			size = ep0_tx_len;
 			if (size > EP0_SIZE) size = EP0_SIZE;
-			endpoint0_transmit(data, size);
+			endpoint0_transmit_data(data, size);
 			data += size;
 			ep0_tx_len -= size;
 			ep0_tx_ptr = (ep0_tx_len > 0 || size == EP0_SIZE) ? data : NULL;
@@ -715,6 +986,7 @@ static void usb_control(uint32_t stat)
 			//serial_phex16(setup.wValue);
 			//serial_print("\n");
 			USB0_ADDR = setup.wValue;
+			USB_BOOT_TIME(address);
 		}
 
 		break;
@@ -736,13 +1008,11 @@ usb_packet_t *usb_rx(uint32_t endpoint)
 	usb_packet_t *ret;
 	endpoint--;
 	if (endpoint >= NUM_ENDPOINTS) return NULL;
-	__disable_irq();
-	ret = rx_first[endpoint];
+	ret = queue_pop(&usb_endpoint_state[endpoint].rx);
 	if (ret) {
-		rx_first[endpoint] = ret->next;
-		usb_rx_byte_count_data[endpoint] -= ret->len;
+		ret->next = NULL;
+		rx_unhold(endpoint);
 	}
-	__enable_irq();
 	//serial_print("rx, epidx=");
 	//serial_phex(endpoint);
 	//serial_print(", packet=");
@@ -751,51 +1021,32 @@ usb_packet_t *usb_rx(uint32_t endpoint)
 	return ret;
 }
 
-static uint32_t usb_queue_byte_count(const usb_packet_t *p)
+// Function removes up to max packets from the receive queue in one
+// step, and returns them as a list linked by next, or NULL if empty
+usb_packet_t *usb_rx_list(uint32_t endpoint, uint32_t max)
 {
-	uint32_t count=0;
+	usb_packet_t *first = NULL, *last = NULL, *p;
 
-	__disable_irq();
-	for ( ; p; p = p->next) {
-		count += p->len;
-	}
-	__enable_irq();
-	return count;
-}
-
-// TODO: make this an inline function...
-/*
-uint32_t usb_rx_byte_count(uint32_t endpoint)
-{
 	endpoint--;
-	if (endpoint >= NUM_ENDPOINTS) return 0;
-	return usb_rx_byte_count_data[endpoint];
-	//return usb_queue_byte_count(rx_first[endpoint]);
-}
-*/
-
-uint32_t usb_tx_byte_count(uint32_t endpoint)
-{
-	endpoint--;
-	if (endpoint >= NUM_ENDPOINTS) return 0;
-	return usb_queue_byte_count(tx_first[endpoint]);
+	if (endpoint >= NUM_ENDPOINTS) return NULL;
+	while (max-- > 0 && (p = queue_pop(&usb_endpoint_state[endpoint].rx)) != NULL) {
+		rx_unhold(endpoint);
+		p->next = NULL;
+		if (last) {
+			last->next = p;
+		} else {
+			first = p;
+		}
+		last = p;
+	}
+	return first;
 }
 
-// Discussion about using this function and USB transmit latency
-// https://forum.pjrc.com/threads/58663?p=223513&viewfull=1#post223513
+// The queue lengths and byte counts are read from the queue's in and
+// out counts, without masking interrupts.  See usb_dev.h.
 //
-uint32_t usb_tx_packet_count(uint32_t endpoint)
-{
-	const usb_packet_t *p;
-	uint32_t count=0;
-
-	endpoint--;
-	if (endpoint >= NUM_ENDPOINTS) return 0;
-	__disable_irq();
-	for (p = tx_first[endpoint]; p; p = p->next) count++;
-	__enable_irq();
-	return count;
-}
+// Discussion about using usb_tx_packet_count and USB transmit latency
+// https://forum.pjrc.com/threads/58663?p=223513&viewfull=1#post223513
 
 
 // Called from usb_free, but only when usb_rx_memory_needed > 0, indicating
@@ -804,117 +1055,198 @@ uint32_t usb_tx_packet_count(uint32_t endpoint)
 // likely calling usb_malloc to obtain memory for transmitting.  When the
 // user is creating data very quickly, their consumption could starve reception
 // without this prioritization.  The packet buffer (input) is assigned to the
-// first endpoint needing memory.
+// highest priority endpoint needing memory, and not yet at its maximum.
 //
 void usb_rx_memory(usb_packet_t *packet)
 {
-	unsigned int i;
-	const uint8_t *cfg;
+	uint32_t ready, endpoint, mask;
+	bdt_t *b;
 
-	cfg = usb_endpoint_config_table;
 	//serial_print("rx_mem:");
-	__disable_irq();
-	for (i=1; i <= NUM_ENDPOINTS; i++) {
-#ifdef AUDIO_INTERFACE
-		if (i == AUDIO_RX_ENDPOINT) continue;
-#endif
-		if (*cfg++ & USB_ENDPT_EPRXEN) {
-			if (table[index(i, RX, EVEN)].desc == 0) {
-				table[index(i, RX, EVEN)].addr = packet->buf;
-				table[index(i, RX, EVEN)].desc = BDT_DESC(64, 0);
-				usb_rx_memory_needed--;
-				__enable_irq();
-				//serial_phex(i);
-				//serial_print(",even\n");
-				return;
-			}
-			if (table[index(i, RX, ODD)].desc == 0) {
-				table[index(i, RX, ODD)].addr = packet->buf;
-				table[index(i, RX, ODD)].desc = BDT_DESC(64, 1);
-				usb_rx_memory_needed--;
-				__enable_irq();
-				//serial_phex(i);
-				//serial_print(",odd\n");
-				return;
-			}
+	mask = usb_irq_mask();
+	ready = rx_starving & ~rx_at_max;
+	ready &= packet_small(packet) ? rx_small : ~rx_small;
+	if (ready) {
+		endpoint = rx_by_rank[__builtin_clz(ready)];
+		b = &table[index(endpoint + 1, RX, EVEN)];
+		if (b->desc != 0) b++;
+		b->addr = packet->buf;
+		b->desc = BDT_DESC(rx_size(endpoint), ((uint32_t)b & 8) ? 1 : 0);
+		rx_hold(endpoint);
+		usb_rx_memory_needed--;
+		if (table[index(endpoint + 1, RX, EVEN)].desc != 0
+		  && table[index(endpoint + 1, RX, ODD)].desc != 0) {
+			rx_starving &= ~RX_BIT(endpoint);
 		}
+		usb_irq_restore(mask);
+		//serial_phex(endpoint + 1);
+		//serial_print(((uint32_t)b & 8) ? ",odd\n" : ",even\n");
+		return;
+	}
+	if (!rx_starving) {
+		// we should never reach this point.  If we get here, it means
+		// usb_rx_memory_needed was set greater than zero, but no memory
+		// was actually needed.
+		usb_rx_memory_needed = 0;
 	}
-	__enable_irq();
-	// we should never reach this point.  If we get here, it means
-	// usb_rx_memory_needed was set greater than zero, but no memory
-	// was actually needed.
-	usb_rx_memory_needed = 0;
-	usb_free(packet);
-	return;
+	usb_irq_restore(mask);
+	// endpoints at their maximum get a buffer after the sketch reads
+	usb_free_to_pool(packet);
 }
 
 //#define index(endpoint, tx, odd) (((endpoint) << 2) | ((tx) << 1) | (odd))
 //#define stat2bufferdescriptor(stat) (table + ((stat) >> 2))
 
-void usb_tx(uint32_t endpoint, usb_packet_t *packet)
+// Function arms queued packets into the free BDT banks of an endpoint.
+// Called only from usb_isr().  endpoint is a zero-based index.
+static void tx_arm(uint32_t endpoint)
 {
-	bdt_t *b = &table[index(endpoint, TX, EVEN)];
-	uint8_t next;
+	usb_endpoint_state_t *ep = &usb_endpoint_state[endpoint];
+	usb_packet_t *packet;
+	bdt_t *b;
+	uint8_t state;
 
+	while (1) {
+		state = ep->tx_state;
+		//serial_print("txstate=");
+		//serial_phex(state);
+		//serial_print("\n");
+		if (TX_ARMED(state) >= 2) return;
+		packet = queue_pop(&ep->tx);
+		if (!packet) return;
+		ep->tx_state = TX_ARM(state);
+		b = &table[index(endpoint + 1, TX, TX_BANK(state))];
+		b->addr = packet->buf;
+		XINPUT_ARM_STAMP(endpoint, b);
+		b->desc = BDT_DESC(packet->len, ((uint32_t)b & 8) ? DATA1 : DATA0);
+	}
+}
+
+// Function queues a packet and has usb_isr() arm it.  The USB interrupt
+// is made pending, so from ordinary code it runs before usb_tx() returns.
+void usb_tx(uint32_t endpoint, usb_packet_t *packet)
+{
 	endpoint--;
 	if (endpoint >= NUM_ENDPOINTS) return;
-	__disable_irq();
-	//serial_print("txstate=");
-	//serial_phex(tx_state[endpoint]);
-	//serial_print("\n");
-	switch (tx_state[endpoint]) {
-	  case TX_STATE_BOTH_FREE_EVEN_FIRST:
-		next = TX_STATE_ODD_FREE;
-		break;
-	  case TX_STATE_BOTH_FREE_ODD_FIRST:
-		b++;
-		next = TX_STATE_EVEN_FREE;
-		break;
-	  case TX_STATE_EVEN_FREE:
-		next = TX_STATE_NONE_FREE_ODD_FIRST;
-		break;
-	  case TX_STATE_ODD_FREE:
-		b++;
-		next = TX_STATE_NONE_FREE_EVEN_FIRST;
-		break;
-	  default:
-		if (tx_first[endpoint] == NULL) {
-			tx_first[endpoint] = packet;
-		} else {
-			tx_last[endpoint]->next = packet;
-		}
-		tx_last[endpoint] = packet;
-		__enable_irq();
-		return;
+	tx_hold(endpoint);
+	queue_push(&usb_endpoint_state[endpoint].tx, packet);
+	usb_atomic_or(&tx_wake, 1 << endpoint);
+	NVIC_SET_PENDING(IRQ_USBOTG);
+}
+
+// Function sends one packet on each of several endpoints, which are all
+// armed in a single pass of usb_isr(), so before the next frame
+void usb_tx_group(uint32_t count, const uint8_t *endpoints, usb_packet_t **packets)
+{
+	uint32_t i, endpoint, wake = 0;
+
+	for (i=0; i < count; i++) {
+		endpoint = endpoints[i] - 1;
+		if (endpoint >= NUM_ENDPOINTS) continue;
+		tx_hold(endpoint);
+		queue_push(&usb_endpoint_state[endpoint].tx, packets[i]);
+		wake |= 1 << endpoint;
 	}
-	tx_state[endpoint] = next;
-	b->addr = packet->buf;
-	b->desc = BDT_DESC(packet->len, ((uint32_t)b & 8) ? DATA1 : DATA0);
-	__enable_irq();
+	usb_atomic_or(&tx_wake, wake);
+	NVIC_SET_PENDING(IRQ_USBOTG);
 }
 
 void usb_tx_isochronous(uint32_t endpoint, void *data, uint32_t len)
 {
 	bdt_t *b = &table[index(endpoint, TX, EVEN)];
-	uint8_t next, state;
+	uint32_t mask;
+	uint8_t state;
 
 	endpoint--;
 	if (endpoint >= NUM_ENDPOINTS) return;
-	__disable_irq();
-	state = tx_state[endpoint];
-	if (state == 0) {
-		next = 1;
-	} else {
-		b++;
-		next = 0;
-	}
-	tx_state[endpoint] = next;
+	mask = usb_irq_mask();
+	state = usb_endpoint_state[endpoint].tx_state;
+	b += TX_BANK(state);
+	usb_endpoint_state[endpoint].tx_state = state ^ 1;
 	b->addr = data;
 	b->desc = (len << 16) | BDT_OWN;
-	__enable_irq();
+	usb_irq_restore(mask);
 }
 
+// Zero copy transmit, for endpoints which own a static buffer for each
+// BDT bank rather than using the packet pool.  usb_tx_direct_bank()
+// tells which bank (EVEN or ODD) the next usb_tx_direct() will use,
+// or -1 if both are still owned by the USB hardware.  Only the
+// transmit complete interrupt can free a bank, so the answer remains
+// valid until the caller arms it.  The transmit complete interrupt
+// must not usb_free() these buffers, see usb_isr().
+int usb_tx_direct_bank(uint32_t endpoint)
+{
+	uint8_t state;
 
+	endpoint--;
+	if (endpoint >= NUM_ENDPOINTS) return -1;
+	state = usb_endpoint_state[endpoint].tx_state;
+	if (TX_ARMED(state) >= 2) return -1;
+	return TX_BANK(state);
+}
+
+// Number of banks (0 to 2) the USB hardware has not yet transmitted
+int usb_tx_direct_inflight(uint32_t endpoint)
+{
+	endpoint--;
+	if (endpoint >= NUM_ENDPOINTS) return 0;
+	return TX_ARMED(usb_endpoint_state[endpoint].tx_state);
+}
+
+int usb_tx_direct(uint32_t endpoint, const void *data, uint32_t len)
+{
+	bdt_t *b = &table[index(endpoint, TX, EVEN)];
+	uint32_t mask;
+	uint8_t state;
+	int bank;
+#ifdef XINPUT_LATENCY_STATS
+	// read before masking, which keeps the critical section short
+	uint32_t cycles = usb_cycle_count();
+#endif
+
+	endpoint--;
+	if (endpoint >= NUM_ENDPOINTS) return -1;
+	mask = usb_irq_mask();
+	state = usb_endpoint_state[endpoint].tx_state;
+	if (TX_ARMED(state) >= 2) {
+		usb_irq_restore(mask);
+		return -1;
+	}
+	bank = TX_BANK(state);
+	b += bank;
+	usb_endpoint_state[endpoint].tx_state = TX_ARM(state);
+	b->addr = (void *)data;
+	XINPUT_ARM_STAMP_AT(endpoint, b, cycles);
+	b->desc = BDT_DESC(len, bank ? DATA1 : DATA0);
+	usb_irq_restore(mask);
+	return bank;
+}
+
+
+
+
+// Free running count of CPU cycles, used to timestamp USB events.
+// Teensy LC has no DWT cycle counter, so it is derived from SysTick,
+// the same way micros() does it.
+uint32_t usb_cycle_count(void)
+{
+#if defined(KINETISK)
+	return ARM_DWT_CYCCNT;
+#else
+	extern volatile uint32_t systick_millis_count;
+	uint32_t count, current, istatus, mask;
+
+	// callers may already have interrupts masked, so restore, not enable
+	mask = usb_irq_mask();
+	current = SYST_CVR;
+	count = systick_millis_count;
+	istatus = SCB_ICSR; // bit 26 indicates if systick exception pending
+	usb_irq_restore(mask);
+	if ((istatus & SCB_ICSR_PENDSTSET) && current > 50) count++;
+	return count * (F_CPU / 1000) + ((F_CPU / 1000) - 1 - current);
+#endif
+}
 
 
 void _reboot_Teensyduino_(void)
@@ -926,60 +1258,225 @@ void _reboot_Teensyduino_(void)
 
 
 
-void usb_isr(void)
+// The reboot timer, and the flush timers and callbacks of the
+// Teensyduino interfaces which send on a schedule.  Their state lives
+// outside this file, so they share the first entry of sof_table.
+static void usb_sof_classes(void)
 {
-	uint8_t status, stat, t;
-
-	//serial_print("isr");
-	//status = USB0_ISTAT;
-	//serial_phex(status);
-	//serial_print("\n");
-	restart:
-	status = USB0_ISTAT;
+	uint8_t t;
 
-	if ((status & USB_ISTAT_SOFTOK /* 04 */ )) {
-		if (usb_configuration) {
-			t = usb_reboot_timer;
-			if (t) {
-				usb_reboot_timer = --t;
-				if (!t) _reboot_Teensyduino_();
-			}
+	t = usb_reboot_timer;
+	if (t) {
+		usb_reboot_timer = --t;
+		if (!t) _reboot_Teensyduino_();
+	}
 #ifdef CDC_DATA_INTERFACE
-			t = usb_cdc_transmit_flush_timer;
-			if (t) {
-				usb_cdc_transmit_flush_timer = --t;
-				if (t == 0) usb_serial_flush_callback();
-			}
+	t = usb_cdc_transmit_flush_timer;
+	if (t) {
+		usb_cdc_transmit_flush_timer = --t;
+		if (t == 0) usb_serial_flush_callback();
+	}
 #endif
 #ifdef CDC2_DATA_INTERFACE
-			t = usb_cdc2_transmit_flush_timer;
-			if (t) {
-				usb_cdc2_transmit_flush_timer = --t;
-				if (t == 0) usb_serial2_flush_callback();
-			}
+	t = usb_cdc2_transmit_flush_timer;
+	if (t) {
+		usb_cdc2_transmit_flush_timer = --t;
+		if (t == 0) usb_serial2_flush_callback();
+	}
 #endif
 #ifdef CDC3_DATA_INTERFACE
-			t = usb_cdc3_transmit_flush_timer;
-			if (t) {
-				usb_cdc3_transmit_flush_timer = --t;
-				if (t == 0) usb_serial3_flush_callback();
-			}
+	t = usb_cdc3_transmit_flush_timer;
+	if (t) {
+		usb_cdc3_transmit_flush_timer = --t;
+		if (t == 0) usb_serial3_flush_callback();
+	}
 #endif
 #ifdef SEREMU_INTERFACE
-			t = usb_seremu_transmit_flush_timer;
-			if (t) {
-				usb_seremu_transmit_flush_timer = --t;
-				if (t == 0) usb_seremu_flush_callback();
-			}
+	t = usb_seremu_transmit_flush_timer;
+	if (t) {
+		usb_seremu_transmit_flush_timer = --t;
+		if (t == 0) usb_seremu_flush_callback();
+	}
 #endif
 #ifdef MIDI_INTERFACE
-                        usb_midi_flush_output();
+	usb_midi_flush_output();
 #endif
 #ifdef FLIGHTSIM_INTERFACE
-			usb_flightsim_flush_callback();
+	usb_flightsim_flush_callback();
 #endif
 #ifdef MULTITOUCH_INTERFACE
-			usb_touchscreen_update_callback();
+	usb_touchscreen_update_callback();
+#endif
+}
+
+// Start of frame handlers, see usb_sof_register().  count is the frames
+// left until the next call.
+typedef struct {
+	void (*handler)(void);
+	uint16_t divisor;
+	uint16_t count;
+#ifdef USB_STATS
+	uint32_t calls;
+	uint32_t cycles;
+	uint32_t max;
+#endif
+} sof_entry_t;
+static sof_entry_t sof_table[USB_SOF_HANDLERS+1] = {{usb_sof_classes, 1, 1}};
+
+int usb_sof_register(void (*handler)(void), uint16_t divisor)
+{
+	sof_entry_t *e;
+	uint32_t mask;
+	int i;
+
+	if (!handler) return -1;
+	if (!divisor) divisor = 1;
+	mask = usb_irq_mask();
+	for (i=1; i <= USB_SOF_HANDLERS; i++) {
+		e = &sof_table[i];
+		if (e->handler) continue;
+		e->divisor = divisor;
+		e->count = divisor;
+#ifdef USB_STATS
+		e->calls = e->cycles = e->max = 0;
+#endif
+		e->handler = handler;
+		usb_irq_restore(mask);
+		return i;
+	}
+	usb_irq_restore(mask);
+	return -1;
+}
+
+void usb_sof_unregister(void (*handler)(void))
+{
+	uint32_t mask;
+	int i;
+
+	mask = usb_irq_mask();
+	for (i=1; i <= USB_SOF_HANDLERS; i++) {
+		if (sof_table[i].handler == handler) sof_table[i].handler = NULL;
+	}
+	usb_irq_restore(mask);
+}
+
+#ifdef USB_STATS
+// Function copies all the counters, as one consistent snapshot
+void usb_stats_read(usb_stats_t *stats)
+{
+	uint32_t mask = usb_irq_mask();
+	memcpy(stats, &usb_stats, sizeof(usb_stats));
+	usb_irq_restore(mask);
+}
+
+void usb_stats_reset(void)
+{
+	uint32_t mask = usb_irq_mask();
+	int i;
+
+	memset(&usb_stats, 0, sizeof(usb_stats));
+	for (i=0; i <= USB_SOF_HANDLERS; i++) {
+		sof_table[i].calls = sof_table[i].cycles = sof_table[i].max = 0;
+	}
+	usb_irq_restore(mask);
+}
+
+void usb_sof_stats_read(usb_sof_stats_t *stats)
+{
+	uint32_t mask;
+	int i;
+
+	mask = usb_irq_mask();
+	for (i=0; i <= USB_SOF_HANDLERS; i++) {
+		stats[i].handler = sof_table[i].handler;
+		stats[i].calls = sof_table[i].calls;
+		stats[i].cycles = sof_table[i].cycles;
+		stats[i].max = sof_table[i].max;
+	}
+	usb_irq_restore(mask);
+}
+#endif
+
+static void usb_sof_work(void)
+{
+	sof_entry_t *e;
+
+	for (e = sof_table; e <= &sof_table[USB_SOF_HANDLERS]; e++) {
+		if (!e->handler || --e->count) continue;
+		e->count = e->divisor;
+#ifdef USB_STATS
+		uint32_t start = usb_cycle_count();
+		e->handler();
+		start = usb_cycle_count() - start;
+		e->calls++;
+		e->cycles += start;
+		if (start > e->max) e->max = start;
+#else
+		e->handler();
+#endif
+	}
+}
+
+#ifdef USB_DEFERRED_IRQ
+// Control transfers and start of frame work, handed from usb_isr() to
+// the lower priority USB_DEFERRED_IRQ, so usb_isr() only moves endpoint
+// data and higher priority interrupts never wait for enumeration.  The
+// ring holds USB0_STAT of each endpoint 0 token; at most the 4 EP0 BDTs
+// can complete before they are handled.
+static volatile uint8_t deferred_sof;
+static uint8_t ep0_stat[8];
+static volatile uint8_t ep0_stat_in, ep0_stat_out;
+
+static void usb_deferred_isr(void)
+{
+	if (deferred_sof) {
+		deferred_sof = 0;
+		if (usb_configuration) usb_sof_work();
+	}
+	while (ep0_stat_out != ep0_stat_in) {
+		// usb_control() shares the BDTs and endpoint state with
+		// usb_isr(), and a reset may have dropped the token.  Only
+		// the USB interrupt is held off, even on Teensy LC.
+		NVIC_DISABLE_IRQ(IRQ_USBOTG);
+		__asm__ volatile("dsb\n\tisb" ::: "memory");
+		if (ep0_stat_out != ep0_stat_in) {
+			usb_control(ep0_stat[ep0_stat_out & 7]);
+			ep0_stat_out++;
+		}
+		NVIC_ENABLE_IRQ(IRQ_USBOTG);
+	}
+}
+#endif
+
+void usb_isr(void)
+{
+	uint8_t status, stat, t;
+
+	//serial_print("isr");
+	//status = USB0_ISTAT;
+	//serial_phex(status);
+	//serial_print("\n");
+	restart:
+	if (tx_wake) {
+		uint32_t wake = tx_wake;
+		tx_wake = 0;
+		do {
+			uint32_t endpoint = __builtin_ctz(wake);
+			tx_arm(endpoint);
+			wake &= wake - 1;
+		} while (wake);
+	}
+	status = USB0_ISTAT;
+
+	if ((status & USB_ISTAT_SOFTOK /* 04 */ )) {
+		usb_sof_cycles = usb_cycle_count();
+		usb_sof_frame = USB0_FRMNUML | ((USB0_FRMNUMH & 7) << 8);
+		if (usb_configuration) {
+#ifdef USB_DEFERRED_IRQ
+			deferred_sof = 1;
+			NVIC_SET_PENDING(USB_DEFERRED_IRQ);
+#else
+			usb_sof_work();
 #endif
 		}
 		USB0_ISTAT = USB_ISTAT_SOFTOK;
@@ -988,16 +1485,92 @@ void usb_isr(void)
 	if ((status & USB_ISTAT_TOKDNE /* 08 */ )) {
 		uint8_t endpoint;
 		stat = USB0_STAT;
+#ifdef USB_STATS
+		uint32_t tokdne_start = usb_cycle_count();
+		if (stat & 0x08) {
+			usb_stats.tx_packets[stat >> 4]++;
+			usb_stats.tx_bytes[stat >> 4] += stat2bufferdescriptor(stat)->desc >> 16;
+		} else {
+			usb_stats.rx_packets[stat >> 4]++;
+			usb_stats.rx_bytes[stat >> 4] += stat2bufferdescriptor(stat)->desc >> 16;
+		}
+#endif
 		//serial_print("token: ep=");
 		//serial_phex(stat >> 4);
 		//serial_print(stat & 0x08 ? ",tx" : ",rx");
 		//serial_print(stat & 0x04 ? ",odd\n" : ",even\n");
 		endpoint = stat >> 4;
+#ifdef XINPUT_INTERFACE
+		// XInput reports are the most frequent token, so they skip the
+		// generic code below: the endpoint, BDT and state are constants
+		if ((stat & 0xF8) == ((XINPUT_TX_ENDPOINT << 4) | 0x08)) {
+			usb_endpoint_state_t *ep = &usb_endpoint_state[XINPUT_TX_ENDPOINT-1];
+			t = TX_DONE(ep->tx_state);
+			// with XINPUT_TX_ZEROCOPY the report buffers are static,
+			// see usb_tx_direct(), so there is nothing to free or pop
+#ifndef XINPUT_TX_ZEROCOPY
+			bdt_t *b = stat2bufferdescriptor(stat);
+			usb_packet_t *packet = (usb_packet_t *)((uint8_t *)(b->addr) - 8);
+			usb_free(packet);
+			tx_unhold(XINPUT_TX_ENDPOINT-1);
+			packet = queue_pop(&ep->tx);
+			if (packet) {
+				b = &table[index(XINPUT_TX_ENDPOINT, TX, TX_BANK(t))];
+				b->addr = packet->buf;
+				XINPUT_ARM_STAMP(XINPUT_TX_ENDPOINT-1, b);
+				b->desc = BDT_DESC(packet->len, TX_BANK(t) ? DATA1 : DATA0);
+				t = TX_ARM(t);
+			}
+#endif
+			ep->tx_state = t;
+#ifdef XINPUT_LATENCY_STATS
+			usb_xinput_latency_isr((stat >> 2) & 1);
+#endif
+#ifdef XINPUT_TX_MAILBOX
+			usb_xinput_mailbox_isr();
+#endif
+			if (usb_xinput_tx_callback != NULL) usb_xinput_tx_callback();
+		} else
+#ifdef XINPUT_RX_PARSE
+		if ((stat & 0xF8) == (XINPUT_RX_ENDPOINT << 4)) {
+			bdt_t *b = stat2bufferdescriptor(stat);
+			// decode in place and give the same buffer straight back
+			usb_xinput_rx_isr(b->addr, b->desc >> 16);
+			b->desc = BDT_DESC(XINPUT_RX_BUFFER_SIZE,
+				((uint32_t)b & 8) ? DATA1 : DATA0);
+			if (usb_xinput_recv_callback != NULL) usb_xinput_recv_callback();
+		} else
+#endif
+#endif
 		if (endpoint == 0) {
+#ifdef USB_DEFERRED_IRQ
+			if (BDT_PID(stat2bufferdescriptor(stat)->desc) == 0x0D) {
+				// A SETUP suspends tokens on every endpoint
+				// until TXSUSPENDTOKENBUSY is cleared.  Drop
+				// what is left of the previous IN data here and
+				// resume now, not when the deferred interrupt
+				// gets to it, so the data endpoints never wait
+				// for a control transfer.
+				ep0_tx_ptr = NULL;
+				ep0_tx_string8 = NULL;
+				ep0_tx_setup_pending = 1;
+				table[index(0, TX, EVEN)].desc = 0;
+				table[index(0, TX, ODD)].desc = 0;
+				USB0_CTL = USB_CTL_USBENSOFEN;
+			}
+			ep0_stat[ep0_stat_in & 7] = stat;
+			ep0_stat_in++;
+			NVIC_SET_PENDING(USB_DEFERRED_IRQ);
+#else
 			usb_control(stat);
+#endif
 		} else {
 			bdt_t *b = stat2bufferdescriptor(stat);
+			usb_endpoint_state_t *ep = &usb_endpoint_state[endpoint - 1];
 			usb_packet_t *packet = (usb_packet_t *)((uint8_t *)(b->addr) - 8);
+#if defined(XINPUT_INTERFACE) && !defined(XINPUT_RX_PARSE)
+			usb_packet_t *rx_handoff = NULL;
+#endif
 #if 0
 			serial_print("ep:");
 			serial_phex(endpoint);
@@ -1018,7 +1591,7 @@ void usb_isr(void)
 					b = (bdt_t *)((uint32_t)b ^ 8);
 					b->addr = usb_audio_transmit_buffer;
 					b->desc = (len << 16) | BDT_OWN;
-					tx_state[endpoint] ^= 1;
+					ep->tx_state ^= 1;
 				}
 			} else if ((endpoint == AUDIO_RX_ENDPOINT-1) && !(stat & 0x08)) {
 				usb_audio_receive_callback(b->desc >> 16);
@@ -1028,102 +1601,85 @@ void usb_isr(void)
 				b = (bdt_t *)((uint32_t)b ^ 8);
 				b->addr = &usb_audio_sync_feedback;
 				b->desc = (3 << 16) | BDT_OWN;
-				tx_state[endpoint] ^= 1;
+				ep->tx_state ^= 1;
 			} else
 #endif
 			if (stat & 0x08) { // transmit
 				usb_free(packet);
-				packet = tx_first[endpoint];
+				tx_unhold(endpoint);
+				packet = queue_pop(&ep->tx);
+				t = TX_DONE(ep->tx_state);
 				if (packet) {
 					//serial_print("tx packet\n");
-					tx_first[endpoint] = packet->next;
+					// the bank after the one still armed, which is
+					// this one unless only this one was armed
+					b = (bdt_t *)(((uint32_t)b & ~8) | (TX_BANK(t) << 3));
 					b->addr = packet->buf;
-					switch (tx_state[endpoint]) {
-					  case TX_STATE_BOTH_FREE_EVEN_FIRST:
-						tx_state[endpoint] = TX_STATE_ODD_FREE;
-						break;
-					  case TX_STATE_BOTH_FREE_ODD_FIRST:
-						tx_state[endpoint] = TX_STATE_EVEN_FREE;
-						break;
-					  case TX_STATE_EVEN_FREE:
-						tx_state[endpoint] = TX_STATE_NONE_FREE_ODD_FIRST;
-						break;
-					  case TX_STATE_ODD_FREE:
-						tx_state[endpoint] = TX_STATE_NONE_FREE_EVEN_FIRST;
-						break;
-					  default:
-						break;
-					}
+					XINPUT_ARM_STAMP(endpoint, b);
 					b->desc = BDT_DESC(packet->len,
 						((uint32_t)b & 8) ? DATA1 : DATA0);
-				} else {
-					//serial_print("tx no packet\n");
-					switch (tx_state[endpoint]) {
-					  case TX_STATE_BOTH_FREE_EVEN_FIRST:
-					  case TX_STATE_BOTH_FREE_ODD_FIRST:
-						break;
-					  case TX_STATE_EVEN_FREE:
-						tx_state[endpoint] = TX_STATE_BOTH_FREE_EVEN_FIRST;
-						break;
-					  case TX_STATE_ODD_FREE:
-						tx_state[endpoint] = TX_STATE_BOTH_FREE_ODD_FIRST;
-						break;
-					  default:
-						tx_state[endpoint] = ((uint32_t)b & 8) ?
-						  TX_STATE_ODD_FREE : TX_STATE_EVEN_FREE;
-						break;
-					}
+					t = TX_ARM(t);
 				}
+				ep->tx_state = t;
 			} else { // receive
 				packet->len = b->desc >> 16;
 				if (packet->len > 0) {
 					packet->index = 0;
 					packet->next = NULL;
-					if (rx_first[endpoint] == NULL) {
-						//serial_print("rx 1st, epidx=");
-						//serial_phex(endpoint);
-						//serial_print(", packet=");
-						//serial_phex32((uint32_t)packet);
-						//serial_print("\n");
-						rx_first[endpoint] = packet;
-					} else {
-						//serial_print("rx Nth, epidx=");
+#if defined(XINPUT_INTERFACE) && !defined(XINPUT_RX_PARSE)
+					if ((endpoint == XINPUT_RX_ENDPOINT-1)
+					  && usb_xinput_packet_callback != NULL) {
+						// given to the callback once the BDT is re-armed
+						rx_handoff = packet;
+						rx_unhold(endpoint);
+					} else
+#endif
+					{
+						//serial_print("rx, epidx=");
 						//serial_phex(endpoint);
 						//serial_print(", packet=");
 						//serial_phex32((uint32_t)packet);
 						//serial_print("\n");
-						rx_last[endpoint]->next = packet;
+						queue_push(&ep->rx, packet);
 					}
-					rx_last[endpoint] = packet;
-					usb_rx_byte_count_data[endpoint] += packet->len;
-					// TODO: implement a per-endpoint maximum # of allocated
-					// packets, so a flood of incoming data on 1 endpoint
-					// doesn't starve the others if the user isn't reading
-					// it regularly
-					packet = usb_malloc();
+					// an endpoint at its ENDPOINTn_QUOTA maximum starves
+					// (NAKs) until the user reads, so a flood of incoming
+					// data on 1 endpoint doesn't starve the others
+					packet = rx_alloc(endpoint);
 					if (packet) {
 						b->addr = packet->buf;
-						b->desc = BDT_DESC(64,
+						b->desc = BDT_DESC(rx_size(endpoint),
 							((uint32_t)b & 8) ? DATA1 : DATA0);
 					} else {
 						//serial_print("starving ");
 						//serial_phex(endpoint + 1);
-						b->desc = 0;
-						usb_rx_memory_needed++;
+						rx_starve(endpoint, b);
 					}
 				} else {
-					b->desc = BDT_DESC(64, ((uint32_t)b & 8) ? DATA1 : DATA0);
+					b->desc = BDT_DESC(rx_size(endpoint),
+						((uint32_t)b & 8) ? DATA1 : DATA0);
 				}
 			}
 			
-#ifdef XINPUT_INTERFACE
+#if defined(XINPUT_INTERFACE) && !defined(XINPUT_RX_PARSE)
 			// On receipt of control packet, call XInput receive callback
 			if((endpoint == XINPUT_RX_ENDPOINT - 1) && !(stat & 0x08)) {
+				if(rx_handoff != NULL) {
+					usb_xinput_packet_callback(rx_handoff->buf, rx_handoff->len);
+				}
 				if(usb_xinput_recv_callback != NULL) { usb_xinput_recv_callback(); }
 			}
 #endif
 
 		}
+#ifdef USB_STATS
+		if (stat & 0xF0) {
+			uint32_t cycles = usb_cycle_count() - tokdne_start;
+			usb_stats.tokdne_count++;
+			usb_stats.tokdne_cycles += cycles;
+			if (cycles > usb_stats.tokdne_max) usb_stats.tokdne_max = cycles;
+		}
+#endif
 		USB0_ISTAT = USB_ISTAT_TOKDNE;
 		goto restart;
 	}
@@ -1132,10 +1688,16 @@ void usb_isr(void)
 
 	if (status & USB_ISTAT_USBRST /* 01 */ ) {
 		//serial_print("reset\n");
+		USB_STATS_INC(resets);
+		USB_BOOT_TIME(bus_reset);
 
 		// initialize BDT toggle bits
 		USB0_CTL = USB_CTL_ODDRST;
 		ep0_tx_bdt_bank = 0;
+#ifdef USB_DEFERRED_IRQ
+		ep0_stat_out = ep0_stat_in;
+		ep0_tx_setup_pending = 0;
+#endif
 
 		// set up buffers to receive Setup and OUT packets
 		table[index(0, RX, EVEN)].desc = BDT_DESC(EP0_SIZE, 0);
@@ -1172,12 +1734,18 @@ void usb_isr(void)
 
 	if ((status & USB_ISTAT_STALL /* 80 */ )) {
 		//serial_print("stall:\n");
+		USB_STATS_INC(stalls);
 		USB0_ENDPT0 = USB_ENDPT_EPRXEN | USB_ENDPT_EPTXEN | USB_ENDPT_EPHSHK;
 		USB0_ISTAT = USB_ISTAT_STALL;
 	}
 	if ((status & USB_ISTAT_ERROR /* 02 */ )) {
 		uint8_t err = USB0_ERRSTAT;
 		USB0_ERRSTAT = err;
+#ifdef USB_STATS
+		for (t=0; t < 8; t++) {
+			if (err & (1 << t)) usb_stats.errors[t]++;
+		}
+#endif
 		//serial_print("err:");
 		//serial_phex(err);
 		//serial_print("\n");
@@ -1186,6 +1754,7 @@ void usb_isr(void)
 
 	if ((status & USB_ISTAT_SLEEP /* 10 */ )) {
 		//serial_print("sleep\n");
+		USB_STATS_INC(sleeps);
 		USB0_ISTAT = USB_ISTAT_SLEEP;
 	}
 
@@ -1200,7 +1769,8 @@ void usb_init(void)
 	//serial_begin(BAUD2DIV(115200));
 	//serial_print("usb_init\n");
 
-	usb_init_serialnumber();
+	USB_BOOT_TIME(init);
+	rx_priority_init();
 
 	for (i=0; i < (NUM_ENDPOINTS+1)*4; i++) {
 		table[i].desc = 0;
@@ -1210,6 +1780,12 @@ void usb_init(void)
 	// this basically follows the flowchart in the Kinetis
 	// Quick Reference User Guide, Rev. 1, 03/2012, page 141
 
+#if defined(KINETISK)
+	// cycle counter for usb_cycle_count()
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+
 	// assume 48 MHz clock already running
 	// SIM - enable clock
 	SIM_SCGC4 |= SIM_SCGC4_USBOTG;
@@ -1246,11 +1822,23 @@ void usb_init(void)
 	USB0_INTEN = USB_INTEN_USBRSTEN;
 
 	// enable interrupt in NVIC...
-	NVIC_SET_PRIORITY(IRQ_USBOTG, 112);
+	NVIC_SET_PRIORITY(IRQ_USBOTG, USB_IRQ_PRIORITY);
 	NVIC_ENABLE_IRQ(IRQ_USBOTG);
+#ifdef USB_DEFERRED_IRQ
+	attachInterruptVector(USB_DEFERRED_IRQ, usb_deferred_isr);
+	NVIC_SET_PRIORITY(USB_DEFERRED_IRQ, USB_DEFERRED_PRIORITY);
+	NVIC_ENABLE_IRQ(USB_DEFERRED_IRQ);
+#endif
 
 	// enable d+ pullup
 	USB0_CONTROL = USB_CONTROL_DPPULLUPNONOTG;
+	USB_BOOT_TIME(pullup);
+
+	// the serial number is read from flash after the pullup, while the
+	// host waits for the connection to settle before its bus reset.
+	// This runs a flash command with interrupts disabled, so it is
+	// never done from an interrupt.
+	usb_init_serialnumber();
 }
 
 
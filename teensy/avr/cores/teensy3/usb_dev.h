@@ -51,22 +51,175 @@ void usb_init(void);
 void usb_init_serialnumber(void);
 void usb_isr(void);
 usb_packet_t *usb_rx(uint32_t endpoint);
-uint32_t usb_tx_byte_count(uint32_t endpoint);
-uint32_t usb_tx_packet_count(uint32_t endpoint);
+usb_packet_t *usb_rx_list(uint32_t endpoint, uint32_t max);
+usb_packet_t * usb_malloc_tx(uint32_t endpoint);
 void usb_tx(uint32_t endpoint, usb_packet_t *packet);
+void usb_tx_group(uint32_t count, const uint8_t *endpoints, usb_packet_t **packets);
 void usb_tx_isochronous(uint32_t endpoint, void *data, uint32_t len);
+int usb_tx_direct_bank(uint32_t endpoint);
+int usb_tx_direct_inflight(uint32_t endpoint);
+int usb_tx_direct(uint32_t endpoint, const void *data, uint32_t len);
 
 extern volatile uint8_t usb_configuration;
+extern volatile uint32_t usb_sof_cycles;
+extern volatile uint16_t usb_sof_frame;
+uint32_t usb_cycle_count(void);
+
+// Code sharing state with usb_isr() masks only the USB interrupt and
+// those of lower priority.  The Cortex-M4 does this with BASEPRI, so
+// higher priority interrupts (eg, a sampling timer) are never delayed,
+// and updates single words with exclusive load/store, retried if an
+// interrupt intervenes.  The Cortex-M0+ in Teensy LC has neither, so
+// it disables all interrupts for these few instructions.  Both save
+// and restore, so they nest.  USB functions must not be called from
+// interrupts of higher priority than USB_IRQ_PRIORITY.
+#ifndef USB_IRQ_PRIORITY
+#define USB_IRQ_PRIORITY 112
+#endif
+
+// Control transfers and start of frame timers and callbacks run from a
+// second interrupt, of lower priority, which usb_isr() makes pending.
+// The hardware stops handling tokens on every endpoint after a SETUP,
+// and usb_isr() resumes it before deferring the request, so a timer
+// with a priority between the two delays enumeration, but not data.
+// It borrows the RTC seconds interrupt, which Teensyduino does
+// not use; a sketch which does can pick another unused IRQ, or define
+// USB_NO_DEFERRED_IRQ to do all the work in usb_isr().
+#if !defined(USB_DEFERRED_IRQ) && !defined(USB_NO_DEFERRED_IRQ)
+#define USB_DEFERRED_IRQ IRQ_RTC_SECOND
+#endif
+#ifndef USB_DEFERRED_PRIORITY
+#define USB_DEFERRED_PRIORITY 176
+#endif
+
+// Functions called at the start of every divisor frames (1 = each
+// frame, every millisecond) while configured, from the deferred USB
+// interrupt, or usb_isr() with USB_NO_DEFERRED_IRQ.  The table has
+// USB_SOF_HANDLERS slots after the built-in serial flush and reboot
+// timers; usb_sof_register() returns the slot, or -1 when full.
+// Handlers may register and unregister from within.
+int usb_sof_register(void (*handler)(void), uint16_t divisor);
+void usb_sof_unregister(void (*handler)(void));
+#if defined(__MKL26Z64__)
+static inline uint32_t usb_irq_mask(void) __attribute__((always_inline, unused));
+static inline uint32_t usb_irq_mask(void)
+{
+	uint32_t prev;
+	__asm__ volatile("mrs %0, primask\n\tcpsid i" : "=r" (prev) :: "memory");
+	return prev;
+}
+static inline void usb_irq_restore(uint32_t prev) __attribute__((always_inline, unused));
+static inline void usb_irq_restore(uint32_t prev)
+{
+	__asm__ volatile("msr primask, %0" :: "r" (prev) : "memory");
+}
+#define usb_atomic_add(p, n) __extension__ ({ uint32_t m_ = usb_irq_mask(); \
+	*(p) += (n); usb_irq_restore(m_); })
+#define usb_atomic_or(p, n) __extension__ ({ uint32_t m_ = usb_irq_mask(); \
+	*(p) |= (n); usb_irq_restore(m_); })
+#define usb_atomic_and(p, n) __extension__ ({ uint32_t m_ = usb_irq_mask(); \
+	*(p) &= (n); usb_irq_restore(m_); })
+#define usb_atomic_cas(p, old, new) __extension__ ({ uint32_t m_ = usb_irq_mask(); \
+	int ok_ = (*(p) == (old)); if (ok_) *(p) = (new); else (old) = *(p); \
+	usb_irq_restore(m_); ok_; })
+#else
+static inline uint32_t usb_irq_mask(void) __attribute__((always_inline, unused));
+static inline uint32_t usb_irq_mask(void)
+{
+	uint32_t prev;
+	__asm__ volatile("mrs %0, basepri\n\tmsr basepri_max, %1"
+		: "=&r" (prev) : "r" (USB_IRQ_PRIORITY) : "memory");
+	return prev;
+}
+static inline void usb_irq_restore(uint32_t prev) __attribute__((always_inline, unused));
+static inline void usb_irq_restore(uint32_t prev)
+{
+	__asm__ volatile("msr basepri, %0" :: "r" (prev) : "memory");
+}
+#define usb_atomic_add(p, n) ((void)__atomic_add_fetch((p), (n), __ATOMIC_SEQ_CST))
+#define usb_atomic_or(p, n) ((void)__atomic_or_fetch((p), (n), __ATOMIC_SEQ_CST))
+#define usb_atomic_and(p, n) ((void)__atomic_and_fetch((p), (n), __ATOMIC_SEQ_CST))
+#define usb_atomic_cas(p, old, new) __atomic_compare_exchange_n((p), &(old), (new), \
+	0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#endif
+
+// Each endpoint's receive and transmit queue is a ring of packet buffer
+// numbers (see usb_mem.c).  usb_isr() is the only producer of receive
+// queues and the only consumer of transmit queues, so taking a packet
+// never masks interrupts.  Adding one masks the USB interrupts for two
+// stores, as transmit queues have several producers; see usb_dev.c.
+// The rings hold every buffer in a pool, so they cannot overflow.  in
+// counts packets added in bits 16-23 and bytes in bits 0-15, out
+// likewise those removed, so the queue length is one subtraction and
+// both update in one store.
+#if NUM_USB_BUFFERS > 16 || NUM_USB_SMALL_BUFFERS > 16
+#define USB_QUEUE_DEPTH 32
+#elif NUM_USB_BUFFERS > 8 || NUM_USB_SMALL_BUFFERS > 8
+#define USB_QUEUE_DEPTH 16
+#else
+#define USB_QUEUE_DEPTH 8
+#endif
+typedef struct {
+	volatile uint32_t in;
+	volatile uint32_t out;
+	uint8_t packet[USB_QUEUE_DEPTH];
+} usb_queue_t;
+
+// Everything usb_isr() changes for an endpoint, kept together so the
+// token done handler reaches it all from one pointer.  tx_state is the
+// BDT bank to arm next and how many are armed, see usb_dev.c.  rx_held
+// and tx_held count the packet buffers held against the endpoint's
+// quota, rx_rank its place in USB_RX_PRIORITY.
+typedef struct {
+	usb_queue_t rx;
+	usb_queue_t tx;
+	volatile uint8_t tx_state;
+	volatile uint8_t rx_held;
+	volatile uint8_t tx_held;
+	uint8_t rx_rank;
+} usb_endpoint_state_t;
+extern usb_endpoint_state_t usb_endpoint_state[NUM_ENDPOINTS];
+
+// out is read first: it only grows, so the result is never negative
+#define USB_QUEUE_PACKETS(q) __extension__ ({ uint32_t o_ = (q)->out; \
+	(uint8_t)(((q)->in >> 16) - (o_ >> 16)); })
+#define USB_QUEUE_BYTES(q) __extension__ ({ uint32_t o_ = (q)->out; \
+	(uint16_t)((q)->in - o_); })
 
-extern uint16_t usb_rx_byte_count_data[NUM_ENDPOINTS];
 static inline uint32_t usb_rx_byte_count(uint32_t endpoint) __attribute__((always_inline));
 static inline uint32_t usb_rx_byte_count(uint32_t endpoint)
 {
         endpoint--;
         if (endpoint >= NUM_ENDPOINTS) return 0;
-        return usb_rx_byte_count_data[endpoint];
+        return USB_QUEUE_BYTES(&usb_endpoint_state[endpoint].rx);
 }
 
+static inline uint32_t usb_tx_byte_count(uint32_t endpoint) __attribute__((always_inline));
+static inline uint32_t usb_tx_byte_count(uint32_t endpoint)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        return USB_QUEUE_BYTES(&usb_endpoint_state[endpoint].tx);
+}
+
+static inline uint32_t usb_rx_packet_count(uint32_t endpoint) __attribute__((always_inline));
+static inline uint32_t usb_rx_packet_count(uint32_t endpoint)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        return USB_QUEUE_PACKETS(&usb_endpoint_state[endpoint].rx);
+}
+
+static inline uint32_t usb_tx_packet_count(uint32_t endpoint) __attribute__((always_inline));
+static inline uint32_t usb_tx_packet_count(uint32_t endpoint)
+{
+        endpoint--;
+        if (endpoint >= NUM_ENDPOINTS) return 0;
+        return USB_QUEUE_PACKETS(&usb_endpoint_state[endpoint].tx);
+}
+
+#include "usb_stats.h"
+
 #ifdef SEREMU_INTERFACE
 extern volatile uint8_t usb_seremu_transmit_flush_timer;
 extern void usb_seremu_flush_callback(void);
@@ -107,6 +260,19 @@ extern void usb_touchscreen_update_callback(void);
 
 #ifdef XINPUT_INTERFACE
 extern void (*usb_xinput_recv_callback)(void);
+extern void (*usb_xinput_packet_callback)(const void *data, uint8_t len);
+extern void (*usb_xinput_tx_callback)(void);
+#ifdef XINPUT_TX_MAILBOX
+extern void usb_xinput_mailbox_isr(void);
+#endif
+#ifdef XINPUT_RX_PARSE
+extern uint8_t usb_xinput_rx_buffer[2][XINPUT_RX_BUFFER_SIZE];
+extern void usb_xinput_rx_isr(const uint8_t *data, uint32_t len);
+#endif
+#ifdef XINPUT_LATENCY_STATS
+extern volatile uint32_t usb_xinput_arm_cycles[2];
+extern void usb_xinput_latency_isr(uint32_t bank);
+#endif
 #endif
 
 
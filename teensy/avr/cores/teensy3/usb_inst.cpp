@@ -92,6 +92,10 @@ usb_serial_class Serial;
 usb_serial_class Serial;
 #endif
 
+#ifdef USB_XINPUT_QUAD
+usb_serial_class Serial;
+#endif
+
 // TODO: other usb types for XInput
 
 
@@ -0,0 +1,192 @@
+/* Teensyduino Core Library
+ * http://www.pjrc.com/teensy/
+ * Copyright (c) 2017 PJRC.COM, LLC.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * 1. The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * 2. If the Software is incorporated into a build system that allows
+ * selection among a list of target devices, then similar target
+ * devices manufactured by PJRC.COM must be included in the list of
+ * target devices and selectable in the same manner.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "usb_dev.h"
+#if F_CPU >= 20000000 && !defined(USB_DISABLED)
+
+#include "kinetis.h"
+//#include "HardwareSerial.h"
+#include "usb_mem.h"
+
+_Static_assert(NUM_USB_BUFFERS >= USB_BUFFERS_NEEDED,
+	"NUM_USB_BUFFERS is less than the ENDPOINTn_QUOTA maximums need");
+_Static_assert(NUM_USB_SMALL_BUFFERS >= USB_SMALL_BUFFERS_NEEDED,
+	"NUM_USB_SMALL_BUFFERS is less than the ENDPOINTn_QUOTA maximums need");
+_Static_assert(NUM_USB_BUFFERS <= 32 && NUM_USB_SMALL_BUFFERS <= 32,
+	"each packet pool has at most 32 buffers");
+
+// The regular pool of packets, followed by the small packet pool
+__attribute__ ((section(".usbbuffers"), used))
+unsigned char usb_buffer_memory[NUM_USB_BUFFERS * sizeof(usb_packet_t)
+	+ NUM_USB_SMALL_BUFFERS * USB_SMALL_PACKET_BYTES];
+
+static volatile uint32_t usb_buffer_available = 0xFFFFFFFF;
+#if NUM_USB_SMALL_BUFFERS > 0
+static volatile uint32_t usb_small_buffer_available = 0xFFFFFFFF;
+#endif
+
+volatile uint8_t usb_buffers_reserved = 0;
+volatile uint8_t usb_small_buffers_reserved = 0;
+
+// bits of a bitmask below which stand for real buffers
+#define POOL_MASK(count) ((count) >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> (count)))
+
+// use bitmask and CLZ instruction to implement fast free list
+// http://www.archivum.info/gnu.gcc.help/2006-08/00148/Re-GCC-Inline-Assembly.html
+// http://gcc.gnu.org/ml/gcc/2012-06/msg00015.html
+// __builtin_clz()
+//
+// The bitmask is claimed with compare and swap (see usb_dev.h), so an
+// interrupt allocating at the same moment makes this one retry, rather
+// than every allocation masking interrupts.
+
+static usb_packet_t * buffer_alloc(uint32_t small, uint32_t keep_reserve)
+{
+	volatile uint32_t *available = &usb_buffer_available;
+	unsigned int n, avail, count = NUM_USB_BUFFERS;
+	unsigned int size = sizeof(usb_packet_t), reserved = usb_buffers_reserved;
+	uint8_t *p = usb_buffer_memory;
+
+#if NUM_USB_SMALL_BUFFERS > 0
+	if (small) {
+		available = &usb_small_buffer_available;
+		count = NUM_USB_SMALL_BUFFERS;
+		size = USB_SMALL_PACKET_BYTES;
+		reserved = usb_small_buffers_reserved;
+		p += NUM_USB_BUFFERS * sizeof(usb_packet_t);
+	}
+#endif
+	avail = *available;
+	do {
+		n = __builtin_clz(avail); // clz = count leading zeros
+		if (n >= count || (keep_reserve
+		  && __builtin_popcount(avail & POOL_MASK(count)) <= reserved)) {
+#ifdef USB_STATS
+			if (small) {
+				usb_stats.small_pool_empty++;
+			} else {
+				usb_stats.pool_empty++;
+			}
+#endif
+			return NULL;
+		}
+	} while (!usb_atomic_cas(available, avail, avail & ~(0x80000000 >> n)));
+	//serial_print("malloc:");
+	//serial_phex(n);
+	//serial_print("\n");
+#ifdef USB_STATS
+	avail = count - __builtin_popcount(avail & POOL_MASK(count)) + 1;
+	if (small) {
+		if (avail > usb_stats.small_pool_high_water) usb_stats.small_pool_high_water = avail;
+	} else {
+		if (avail > usb_stats.pool_high_water) usb_stats.pool_high_water = avail;
+	}
+#endif
+	p += n * size;
+	//serial_print("malloc:");
+	//serial_phex32((int)p);
+	//serial_print("\n");
+	*(uint32_t *)p = 0;
+	*(uint32_t *)(p + 4) = 0;
+	return (usb_packet_t *)p;
+}
+
+// Function allocates a packet, leaving the buffers reserved for
+// endpoints below their quota
+usb_packet_t * usb_malloc(void)
+{
+	return buffer_alloc(0, 1);
+}
+
+// Function allocates a packet from the small pool, with only
+// USB_SMALL_PACKET_SIZE bytes of buf
+usb_packet_t * usb_malloc_small(void)
+{
+	return buffer_alloc(1, 1);
+}
+
+// Function allocates a packet for an endpoint still below its reserved
+// minimum, so it may use the reserved buffers
+usb_packet_t * usb_malloc_reserved(uint32_t small)
+{
+	return buffer_alloc(small, 0);
+}
+
+// for the receive endpoints to request memory
+extern uint8_t usb_rx_memory_needed;
+extern void usb_rx_memory(usb_packet_t *packet);
+
+void usb_free(usb_packet_t *p)
+{
+	//serial_print("free:");
+	if ((uint8_t *)p < usb_buffer_memory
+	  || (uint8_t *)p >= usb_buffer_memory + sizeof(usb_buffer_memory)) return;
+
+	// if any endpoints are starving for memory to receive
+	// packets, give this memory to them immediately!
+	if (usb_rx_memory_needed && usb_configuration) {
+		//serial_print("give to rx:");
+		//serial_phex32((int)p);
+		//serial_print("\n");
+		usb_rx_memory(p);
+		return;
+	}
+	usb_free_to_pool(p);
+
+	//serial_print("free:");
+	//serial_phex32((int)p);
+	//serial_print("\n");
+}
+
+// Function returns a packet to its pool, without offering it to
+// starving receive endpoints first
+void usb_free_to_pool(usb_packet_t *p)
+{
+	unsigned int n = (uint8_t *)p - usb_buffer_memory;
+
+#if NUM_USB_BUFFERS > 0
+	if (n < NUM_USB_BUFFERS * sizeof(usb_packet_t)) {
+		n /= sizeof(usb_packet_t);
+		//serial_phex(n);
+		//serial_print("\n");
+		usb_atomic_or(&usb_buffer_available, 0x80000000 >> n);
+		return;
+	}
+	n -= NUM_USB_BUFFERS * sizeof(usb_packet_t);
+#endif
+#if NUM_USB_SMALL_BUFFERS > 0
+	n /= USB_SMALL_PACKET_BYTES;
+	if (n < NUM_USB_SMALL_BUFFERS) {
+		usb_atomic_or(&usb_small_buffer_available, 0x80000000 >> n);
+	}
+#endif
+}
+
+#endif // F_CPU >= 20 MHz && !defined(USB_DISABLED)
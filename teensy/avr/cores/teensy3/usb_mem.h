@@ -0,0 +1,68 @@
+/* Teensyduino Core Library
+ * http://www.pjrc.com/teensy/
+ * Copyright (c) 2017 PJRC.COM, LLC.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * 1. The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * 2. If the Software is incorporated into a build system that allows
+ * selection among a list of target devices, then similar target
+ * devices manufactured by PJRC.COM must be included in the list of
+ * target devices and selectable in the same manner.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _usb_mem_h_
+#define _usb_mem_h_
+
+#include <stdint.h>
+
+typedef struct usb_packet_struct {
+	uint16_t len;
+	uint16_t index;
+	struct usb_packet_struct *next;
+	uint8_t buf[64];
+} usb_packet_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+usb_packet_t * usb_malloc(void);
+usb_packet_t * usb_malloc_small(void);
+usb_packet_t * usb_malloc_reserved(uint32_t small);
+void usb_free(usb_packet_t *p);
+void usb_free_to_pool(usb_packet_t *p);
+
+// A packet from usb_malloc_small() has only USB_SMALL_PACKET_SIZE bytes
+// of buf, so it takes this much memory
+#define USB_SMALL_PACKET_BYTES (sizeof(usb_packet_t) - 64 + USB_SMALL_PACKET_SIZE)
+
+// Buffers usb_malloc() must leave for endpoints below their reserved
+// minimum (see ENDPOINTn_QUOTA in usb_desc.h), for each pool.  Kept by
+// usb_dev.c.
+extern volatile uint8_t usb_buffers_reserved;
+extern volatile uint8_t usb_small_buffers_reserved;
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,109 @@
+/* Teensyduino Core Library
+ * http://www.pjrc.com/teensy/
+ * Copyright (c) 2017 PJRC.COM, LLC.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * 1. The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * 2. If the Software is incorporated into a build system that allows
+ * selection among a list of target devices, then similar target
+ * devices manufactured by PJRC.COM must be included in the list of
+ * target devices and selectable in the same manner.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _usb_stats_h_
+#define _usb_stats_h_
+
+#include "usb_desc.h"
+
+// USB_STATS counters (see usb_desc.h), for sketches as well as the
+// USB code.  WProgram.h includes this, so a sketch can call
+// usb_stats_read() without the internal usb_dev.h.
+#if F_CPU >= 20000000 && !defined(USB_DISABLED) && defined(USB_STATS) && defined(NUM_ENDPOINTS)
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counters kept by the USB code.  The per-endpoint arrays are indexed
+// by endpoint number, including endpoint 0.
+typedef struct {
+	uint32_t rx_packets[NUM_ENDPOINTS+1];
+	uint32_t rx_bytes[NUM_ENDPOINTS+1];
+	uint32_t tx_packets[NUM_ENDPOINTS+1];
+	uint32_t tx_bytes[NUM_ENDPOINTS+1];
+	uint32_t rx_starved;		// receive buffer not refilled, pool empty
+	uint32_t pool_empty;		// usb_malloc() returned NULL
+	uint32_t pool_high_water;	// most packet buffers in use at once
+	uint32_t small_pool_empty;	// likewise for the small packet pool
+	uint32_t small_pool_high_water;
+	uint32_t send_timeouts;		// usb_xinput_send() gave up
+	uint32_t errors[8];		// USB0_ERRSTAT bits, see below
+	uint32_t stalls;
+	uint32_t resets;
+	uint32_t sleeps;
+	uint32_t tokdne_count;		// endpoint token done interrupts
+	uint32_t tokdne_cycles;		// CPU cycles they took, in total
+	uint32_t tokdne_max;		// and the longest one
+	uint32_t control_setups;	// setup packets on endpoint 0
+	uint32_t enum_transactions;	// endpoint 0 transactions before the
+	uint32_t enum_setups;		// first SET_CONFIGURATION, and setups
+} usb_stats_t;
+#define USB_STATS_PIDERR	0
+#define USB_STATS_CRC5EOF	1
+#define USB_STATS_CRC16		2
+#define USB_STATS_DFN8		3
+#define USB_STATS_BTOERR	4
+#define USB_STATS_DMAERR	5
+#define USB_STATS_BTSERR	7
+extern usb_stats_t usb_stats;
+void usb_stats_read(usb_stats_t *stats);
+void usb_stats_reset(void);
+
+// Cost of each start of frame handler, from usb_sof_stats_read(), which
+// fills USB_SOF_HANDLERS+1 of these.  The first is the built-in class
+// timers, the rest the usb_sof_register() slots (handler NULL if free).
+typedef struct {
+	void (*handler)(void);
+	uint32_t calls;
+	uint32_t cycles;		// CPU cycles, in total
+	uint32_t max;			// longest call
+} usb_sof_stats_t;
+void usb_sof_stats_read(usb_sof_stats_t *stats);
+
+// micros() since the processor reset at each step of the first
+// enumeration, or 0 until it happens.  Not cleared by usb_stats_reset().
+typedef struct {
+	uint32_t init;			// usb_init() called
+	uint32_t pullup;		// D+ pullup on, the host can see us
+	uint32_t bus_reset;		// first USB reset from the host
+	uint32_t address;		// SET_ADDRESS done
+	uint32_t configured;		// SET_CONFIGURATION
+} usb_boot_times_t;
+extern usb_boot_times_t usb_boot_times;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // USB_STATS
+#endif
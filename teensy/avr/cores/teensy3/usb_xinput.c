@@ -34,6 +34,9 @@
 static const uint32_t timeout = 250;  // ms
 
 void (*usb_xinput_recv_callback)(void) = NULL;
+void (*usb_xinput_packet_callback)(const void *data, uint8_t len) = NULL;
+void (*usb_xinput_tx_callback)(void) = NULL;
+static void (*frame_callback)(void) = NULL;
 
 // Function returns whether the microcontroller's USB
 // is configured or not (connected to driver)
@@ -42,60 +45,709 @@ bool usb_xinput_connected(void)
 	return usb_configuration;
 }
 
-// Function to check if packets are available
-// to be received on the RX endpoint
+#ifdef XINPUT_RX_PARSE
+
+// OUT packets land in these buffers and are decoded by the interrupt,
+// which then re-arms the same buffer, so no packet memory is used
+uint8_t usb_xinput_rx_buffer[2][XINPUT_RX_BUFFER_SIZE] __attribute__ ((aligned (4)));
+static volatile usb_xinput_output_t output;
+static uint8_t rx_latest[XINPUT_RX_BUFFER_SIZE];
+static volatile uint8_t rx_latest_len = 0;
+
+// Called from usb_isr() with each packet received on the RX endpoint.
+// LED messages are 01 03 NN, rumble messages are 00 08 00 LL RR 00 00 00.
+void usb_xinput_rx_isr(const uint8_t *data, uint32_t len)
+{
+	if (len == 0) return;
+	if (len > XINPUT_RX_BUFFER_SIZE) len = XINPUT_RX_BUFFER_SIZE;
+	if (len >= 3 && data[0] == 0x01 && data[1] == 0x03) {
+		output.led = data[2];
+		output.led_count++;
+	} else if (len >= 5 && data[0] == 0x00 && data[1] == 0x08) {
+		output.rumble_left = data[3];
+		output.rumble_right = data[4];
+		output.rumble_count++;
+	}
+	// the newest packet is also kept for usb_xinput_recv()
+	memcpy(rx_latest, data, len);
+	rx_latest_len = len;
+	if (usb_xinput_packet_callback != NULL) usb_xinput_packet_callback(data, len);
+}
+
+// Received data is handed to the packet callback in place, and is only
+// valid until the callback returns
+void usb_xinput_release(const void *data)
+{
+}
+
+// Function copies the latest LED and rumble settings from the host
+void usb_xinput_read_output(usb_xinput_output_t *out)
+{
+	uint32_t mask = usb_irq_mask();
+
+	out->led = output.led;
+	out->rumble_left = output.rumble_left;
+	out->rumble_right = output.rumble_right;
+	out->led_count = output.led_count;
+	out->rumble_count = output.rumble_count;
+	usb_irq_restore(mask);
+}
+
+// Function returns the size of the newest packet not yet received
 uint16_t usb_xinput_available(void)
 {
-	uint16_t count;
+	if (!usb_configuration) return 0;
+	return rx_latest_len;
+}
+
+// Function receives the newest packet from the RX endpoint.  Older
+// packets not received in time are only seen through
+// usb_xinput_read_output().
+int usb_xinput_recv(void *buffer, uint8_t nbytes)
+{
+	uint32_t begin = millis();
+	uint32_t mask;
+
+	while (1) {
+		if (!usb_configuration) return -1;
+		if (rx_latest_len) break;
+		if (millis() - begin > timeout || !timeout) return 0;
+		yield();
+	}
+	mask = usb_irq_mask();
+	if (nbytes > rx_latest_len) nbytes = rx_latest_len;
+	memcpy(buffer, rx_latest, nbytes);
+	rx_latest_len = 0;
+	usb_irq_restore(mask);
+	return nbytes;
+}
+
+// Only one controller is supported when decoding in the interrupt
+uint16_t usb_xinput_available_from(uint8_t n)
+{
+	return (n == 0) ? usb_xinput_available() : 0;
+}
+
+int usb_xinput_recv_from(uint8_t n, void *buffer, uint8_t nbytes)
+{
+	if (n != 0) return -1;
+	return usb_xinput_recv(buffer, nbytes);
+}
 
+// Only the newest packet is kept, so a batch is at most one packet
+int usb_xinput_recv_batch(usb_xinput_packet_t *packets, uint8_t max)
+{
+	int count = 0;
+	uint32_t mask;
+
+	if (!usb_configuration) return -1;
+	if (max == 0) return 0;
+	mask = usb_irq_mask();
+	if (rx_latest_len) {
+		packets->len = rx_latest_len;
+		memcpy(packets->data, rx_latest, rx_latest_len);
+		rx_latest_len = 0;
+		count = 1;
+	}
+	usb_irq_restore(mask);
+	return count;
+}
+
+uint16_t usb_xinput_available_packets(void)
+{
 	if (!usb_configuration) return 0;
-	count = usb_rx_byte_count(XINPUT_RX_ENDPOINT);
+	return rx_latest_len ? 1 : 0;
+}
+
+#else
+
+// Function to check if packets are available
+// to be received on controller n's RX endpoint
+uint16_t usb_xinput_available_from(uint8_t n)
+{
+	uint16_t count;
+
+	if (!usb_configuration || n >= XINPUT_COUNT) return 0;
+	count = usb_rx_byte_count(XINPUT_RX_ENDPOINT_N(n));
 	return count;
 }
 
+uint16_t usb_xinput_available(void)
+{
+	return usb_xinput_available_from(0);
+}
 
-// Function receives packets from the RX endpoint
-int usb_xinput_recv(void *buffer, uint8_t nbytes)
+// Function receives packets from controller n's RX endpoint
+int usb_xinput_recv_from(uint8_t n, void *buffer, uint8_t nbytes)
 {
 	usb_packet_t *rx_packet;
 	uint32_t begin = millis();
 
+	if (n >= XINPUT_COUNT) return -1;
 	while (1) {
 		if (!usb_configuration) return -1;
-		rx_packet = usb_rx(XINPUT_RX_ENDPOINT);
+		rx_packet = usb_rx(XINPUT_RX_ENDPOINT_N(n));
 		if (rx_packet) break;
 		if (millis() - begin > timeout || !timeout) return 0;
 		yield();
 	}
+	if (nbytes > rx_packet->len) nbytes = rx_packet->len;
 	memcpy(buffer, rx_packet->buf, nbytes);
 	usb_free(rx_packet);
 	return nbytes;
 }
 
-// Maximum number of transmit packets to queue so we don't starve other endpoints for memory
-#define TX_PACKET_LIMIT 3
+int usb_xinput_recv(void *buffer, uint8_t nbytes)
+{
+	return usb_xinput_recv_from(0, buffer, nbytes);
+}
+
+// Function receives every queued packet, up to max, without waiting.
+// The packets are taken from the queue together, so a burst from the
+// host costs one pass.  Returns the number of packets received.
+int usb_xinput_recv_batch(usb_xinput_packet_t *packets, uint8_t max)
+{
+	usb_packet_t *p, *next;
+	int count = 0;
+	uint32_t len;
 
-// Function used to send packets out of the TX endpoint
-// This is used to send button reports
-int usb_xinput_send(const void *buffer, uint8_t nbytes)
+	if (!usb_configuration) return -1;
+	p = usb_rx_list(XINPUT_RX_ENDPOINT, max);
+	while (p) {
+		len = p->len;
+		if (len > XINPUT_RX_BUFFER_SIZE) len = XINPUT_RX_BUFFER_SIZE;
+		packets[count].len = len;
+		memcpy(packets[count].data, p->buf, len);
+		count++;
+		next = p->next;
+		usb_free(p);
+		p = next;
+	}
+	return count;
+}
+
+// Function returns the number of packets waiting to be received
+uint16_t usb_xinput_available_packets(void)
 {
-	usb_packet_t *tx_packet;
-	uint32_t begin = millis();
+	if (!usb_configuration) return 0;
+	return usb_rx_packet_count(XINPUT_RX_ENDPOINT);
+}
+
+// Function frees a packet given to usb_xinput_packet_callback.  The
+// callback may call it itself, or keep the data and call it later.
+void usb_xinput_release(const void *data)
+{
+	usb_free((usb_packet_t *)((uint8_t *)data - 8));
+}
+
+#endif // XINPUT_RX_PARSE
+
+// Function sets the one callback called at each start of frame, in the
+// start of frame handler table (see usb_sof_register), replacing any
+// previous one.  NULL removes it.  Returns -1 if the table is full.
+int usb_xinput_set_frame_callback(void (*callback)(void))
+{
+	if (frame_callback) usb_sof_unregister(frame_callback);
+	frame_callback = NULL;
+	if (!callback) return 0;
+	if (usb_sof_register(callback, 1) < 0) return -1;
+	frame_callback = callback;
+	return 0;
+}
+
+// Functions add and remove a start of frame handler, called every
+// divisor frames, for sketches, which don't include usb_dev.h
+int usb_xinput_add_frame_handler(void (*handler)(void), uint16_t divisor)
+{
+	return usb_sof_register(handler, divisor);
+}
+
+void usb_xinput_remove_frame_handler(void (*handler)(void))
+{
+	usb_sof_unregister(handler);
+}
+
+// USB frame number (0 to 2047) of the last start of frame
+uint16_t usb_xinput_frame_number(void)
+{
+	return usb_sof_frame;
+}
 
+// CPU cycle count (see usb_cycle_count()) at the last start of frame
+uint32_t usb_xinput_frame_cycles(void)
+{
+	return usb_sof_cycles;
+}
+
+// Microseconds since the last start of frame
+uint32_t usb_xinput_frame_phase(void)
+{
+	return (usb_cycle_count() - usb_sof_cycles) / (F_CPU / 1000000);
+}
+
+// Function waits until lead_us microseconds before the next start of
+// frame, once per frame, so inputs sampled and sent right after are
+// armed just in time for the host's next poll.  It spins rather than
+// calling yield(), which would add jitter.  If the next start of frame
+// comes first, as it does when lead_us is shorter than the USB
+// interrupt's latency, it returns just after it instead.  Returns the
+// number of the current frame, or -1 if not configured or the host
+// stopped sending start of frame (suspend).
+int usb_xinput_wait_frame_phase(uint16_t lead_us)
+{
+	static uint16_t last_frame = 0xFFFF;
+	const uint32_t cycles_per_us = F_CPU / 1000000;
+	uint32_t target, start, elapsed, waiting = 0x10000;
+	uint16_t frame;
+
+	if (lead_us > 1000) lead_us = 1000;
+	target = (1000 - lead_us) * cycles_per_us;
 	while (1) {
 		if (!usb_configuration) return -1;
-		if (usb_tx_packet_count(XINPUT_TX_ENDPOINT) < TX_PACKET_LIMIT) {
-			tx_packet = usb_malloc();
-			if (tx_packet) break;
+		do {
+			frame = usb_sof_frame;
+			start = usb_sof_cycles;
+		} while (frame != usb_sof_frame);
+		elapsed = usb_cycle_count() - start;
+		if (elapsed > 3000 * cycles_per_us) return -1;
+		if (frame != last_frame) {
+			if (elapsed >= target) {
+				last_frame = frame;
+				return frame;
+			}
+			// a late return counts for the frame waited in, so
+			// the next call waits in this one
+			if (waiting <= 0xFFFF && frame != waiting) {
+				last_frame = waiting;
+				return frame;
+			}
+			waiting = frame;
 		}
-		if (millis() - begin > timeout) return 0;
-		yield();
 	}
+}
+
+#ifdef XINPUT_LATENCY_STATS
+
+// Each report's send time waits in this FIFO until its transmit
+// completes.  Reports complete in the order they were sent, so the
+// oldest entry always belongs to the report just completed.
+#define LATENCY_FIFO_SIZE 8
+static uint32_t latency_fifo[LATENCY_FIFO_SIZE];
+static volatile uint8_t latency_head = 0;
+static volatile uint8_t latency_tail = 0;
+static usb_xinput_latency_t latency;
+static uint32_t latency_deadline = 1000 * (F_CPU / 1000000);
+
+// Function records the send time of a report about to be queued.  With
+// replace set, the report replaces the newest queued one instead.
+static void latency_enqueue(int replace)
+{
+	uint32_t head = latency_head;
+
+	if (replace && head != latency_tail) {
+		latency_fifo[(head - 1) & (LATENCY_FIFO_SIZE - 1)] = usb_cycle_count();
+		return;
+	}
+	// with nothing in flight, any leftover entries are stale (reset)
+	if (usb_tx_direct_inflight(XINPUT_TX_ENDPOINT) == 0
+	  && usb_tx_packet_count(XINPUT_TX_ENDPOINT) == 0) {
+		latency_tail = head;
+	}
+	if (((head + 1) & (LATENCY_FIFO_SIZE - 1)) == latency_tail) return;
+	latency_fifo[head] = usb_cycle_count();
+	latency_head = (head + 1) & (LATENCY_FIFO_SIZE - 1);
+}
+
+// Function drops the send time recorded for a report which was not queued
+static void latency_cancel(void)
+{
+	uint32_t head = latency_head;
+
+	if (head != latency_tail) latency_head = (head - 1) & (LATENCY_FIFO_SIZE - 1);
+}
+
+static void latency_add(uint32_t *histogram, uint32_t cycles)
+{
+	uint32_t n = cycles / (F_CPU / 1000000) / XINPUT_LATENCY_BUCKET_US;
+
+	if (n >= XINPUT_LATENCY_BUCKETS) n = XINPUT_LATENCY_BUCKETS - 1;
+	histogram[n]++;
+}
+
+// Called from usb_isr() when a report on the given BDT bank completes
+void usb_xinput_latency_isr(uint32_t bank)
+{
+	uint32_t now, sent, armed, tail, us;
+
+	now = usb_cycle_count();
+	tail = latency_tail;
+	if (tail == latency_head) return;
+	sent = latency_fifo[tail];
+	latency_tail = (tail + 1) & (LATENCY_FIFO_SIZE - 1);
+	armed = usb_xinput_arm_cycles[bank];
+	if ((int32_t)(armed - sent) < 0) armed = sent;
+	latency_add(latency.queued, armed - sent);
+	latency_add(latency.wire, now - armed);
+	latency_add(latency.total, now - sent);
+	if (now - sent > latency_deadline) latency.deadline_misses++;
+	us = (now - sent) / (F_CPU / 1000000);
+	if (us > latency.max_us) latency.max_us = us;
+	latency.count++;
+}
+
+// Function copies the latency statistics, as one consistent snapshot
+void usb_xinput_latency_read(usb_xinput_latency_t *stats)
+{
+	uint32_t mask = usb_irq_mask();
+
+	memcpy(stats, &latency, sizeof(latency));
+	usb_irq_restore(mask);
+}
+
+void usb_xinput_latency_reset(void)
+{
+	uint32_t mask = usb_irq_mask();
+
+	memset(&latency, 0, sizeof(latency));
+	usb_irq_restore(mask);
+}
+
+// Reports taken longer than this from send to transmit complete
+// count as deadline misses.  The default is 1000 us (one frame).
+void usb_xinput_set_latency_deadline(uint32_t deadline_us)
+{
+	latency_deadline = deadline_us * (F_CPU / 1000000);
+}
+
+#else
+#define latency_enqueue(replace) ((void)0)
+#define latency_cancel() ((void)0)
+#endif // XINPUT_LATENCY_STATS
+
+// Change-only reporting: when enabled, a report identical to the last
+// one sent is skipped, but still reported as sent.  A nonzero keepalive
+// forces a resend once that many milliseconds have passed, even when
+// nothing changed.
+#define XINPUT_TX_WORDS ((XINPUT_TX_SIZE + 3) / 4)
+static uint32_t tx_last[XINPUT_COUNT][XINPUT_TX_WORDS];
+static uint8_t tx_last_len[XINPUT_COUNT];
+static uint8_t tx_change_only = 0;
+static uint16_t tx_keepalive = 0;
+static uint32_t tx_last_millis[XINPUT_COUNT];
+
+// Function forgets the last reports, so the next ones are always sent
+static void report_forget(void)
+{
+	memset(tx_last_len, 0, sizeof(tx_last_len));
+}
+
+void usb_xinput_set_change_only(uint8_t enable, uint16_t keepalive_ms)
+{
+	tx_change_only = enable;
+	tx_keepalive = keepalive_ms;
+	report_forget();
+}
+
+// Function returns true if controller n's report can be skipped
+static int report_unchanged(uint8_t n, const void *buffer, uint8_t nbytes)
+{
+	const uint32_t *last = tx_last[n];
+	uint32_t i;
+
+	if (!tx_change_only || nbytes != tx_last_len[n]) return 0;
+	if (tx_keepalive && (millis() - tx_last_millis[n]) >= tx_keepalive) return 0;
+	if (((uint32_t)buffer & 3) == 0) {
+		const uint32_t *p = (const uint32_t *)buffer;
+		for (i=0; i < (uint32_t)(nbytes >> 2); i++) {
+			if (p[i] != last[i]) return 0;
+		}
+		i <<= 2;
+	} else {
+		i = 0;
+	}
+	return memcmp((const uint8_t *)buffer + i, (const uint8_t *)last + i, nbytes - i) == 0;
+}
+
+// Function remembers the report being sent, for report_unchanged()
+static void report_sent(uint8_t n, const void *buffer, uint8_t nbytes)
+{
+	if (!tx_change_only) return;
+	if (nbytes > sizeof(tx_last[n])) {
+		tx_last_len[n] = 0;
+		return;
+	}
+	memcpy(tx_last[n], buffer, nbytes);
+	tx_last_len[n] = nbytes;
+	tx_last_millis[n] = millis();
+}
+
+#ifdef XINPUT_TX_ZEROCOPY
+
+// Reports are built in two static buffers, one for each BDT bank of
+// the transmit endpoint.  The USB hardware reads them in place, so
+// sending needs no usb_malloc(), no copy and no packet queue.
+#define XINPUT_TX_BUFFER_SIZE ((XINPUT_TX_SIZE + 3) & ~3)
+static uint8_t tx_report[2][XINPUT_TX_BUFFER_SIZE] __attribute__ ((aligned (4)));
+static int8_t tx_acquired = -1;
+
+#ifdef XINPUT_TX_MAILBOX
+
+// Mailbox mode keeps at most one report armed for the host.  The other
+// buffer holds the newest committed report until the armed one is read;
+// committing again before then simply replaces it, so the host never
+// reads a backlog of old reports.  An armed buffer belongs to the USB
+// hardware and cannot be rewritten, so the newest state reaches the host
+// on the poll after the one already armed.
+static volatile uint8_t tx_pending = 0;	// length of waiting report, 0 if none
+static volatile uint8_t tx_writing = 0;	// sketch holds the waiting buffer
+
+// Function returns the report buffer to fill in for the next send
+void * usb_xinput_acquire(void)
+{
+	int bank;
+	uint32_t mask;
+
+	if (!usb_configuration) return NULL;
+	mask = usb_irq_mask();
+	bank = usb_tx_direct_bank(XINPUT_TX_ENDPOINT);
+	if (bank >= 0) {
+		tx_writing = 1;
+		tx_acquired = bank;
+	}
+	usb_irq_restore(mask);
+	if (bank < 0) return NULL;
+	return tx_report[bank];
+}
+
+// Function sends the buffer returned by usb_xinput_acquire(), or
+// leaves it waiting for the armed report to be read
+int usb_xinput_commit(uint8_t nbytes)
+{
+	int bank = tx_acquired;
+	uint32_t mask;
+
+	if (bank < 0) return 0;
+	tx_acquired = -1;
+	if (!usb_configuration) {
+		tx_writing = 0;
+		return -1;
+	}
+	if (nbytes > XINPUT_TX_SIZE) nbytes = XINPUT_TX_SIZE;
+	if (report_unchanged(0, tx_report[bank], nbytes)) {
+		// nothing new, but a report may still be waiting in this buffer
+		if (!tx_pending) {
+			tx_writing = 0;
+			return nbytes;
+		}
+		nbytes = tx_pending;
+		mask = usb_irq_mask();
+	} else {
+		report_sent(0, tx_report[bank], nbytes);
+		mask = usb_irq_mask();
+		latency_enqueue(tx_pending != 0);
+	}
+	tx_writing = 0;
+	if (usb_tx_direct_inflight(XINPUT_TX_ENDPOINT) > 0) {
+		tx_pending = nbytes;
+		usb_irq_restore(mask);
+		return nbytes;
+	}
+	tx_pending = 0;
+	usb_tx_direct(XINPUT_TX_ENDPOINT, tx_report[bank], nbytes);
+	usb_irq_restore(mask);
+	return nbytes;
+}
+
+// Called from usb_isr() when the armed report has been read by the
+// host.  Arms the waiting report, unless the sketch is still filling it
+// in, in which case usb_xinput_commit() will arm it.
+void usb_xinput_mailbox_isr(void)
+{
+	uint8_t len = tx_pending;
+	int bank;
+
+	if (!len || tx_writing) return;
+	bank = usb_tx_direct_bank(XINPUT_TX_ENDPOINT);
+	if (bank < 0) return;
+	tx_pending = 0;
+	usb_tx_direct(XINPUT_TX_ENDPOINT, tx_report[bank], len);
+}
+
+#else // XINPUT_TX_MAILBOX
+
+// Function returns the report buffer to fill in for the next send,
+// or NULL if both buffers are still waiting for the host
+void * usb_xinput_acquire(void)
+{
+	int bank;
+	uint32_t mask;
+
+	if (!usb_configuration) return NULL;
+	mask = usb_irq_mask();
+	bank = usb_tx_direct_bank(XINPUT_TX_ENDPOINT);
+	if (bank >= 0) tx_acquired = bank;
+	usb_irq_restore(mask);
+	if (bank < 0) return NULL;
+	return tx_report[bank];
+}
+
+// Function sends the buffer returned by usb_xinput_acquire()
+int usb_xinput_commit(uint8_t nbytes)
+{
+	int bank = tx_acquired;
+
+	if (bank < 0) return 0;
+	tx_acquired = -1;
+	if (!usb_configuration) return -1;
+	if (nbytes > XINPUT_TX_SIZE) nbytes = XINPUT_TX_SIZE;
+	if (report_unchanged(0, tx_report[bank], nbytes)) return nbytes;
+	latency_enqueue(0);
+	if (usb_tx_direct(XINPUT_TX_ENDPOINT, tx_report[bank], nbytes) < 0) {
+		latency_cancel();
+		return 0;
+	}
+	report_sent(0, tx_report[bank], nbytes);
+	return nbytes;
+}
+
+#endif // XINPUT_TX_MAILBOX
+
+// Function sends a report if a buffer is free, without waiting.  Called
+// from an interrupt while the sketch holds a buffer from acquire(), it
+// returns 0 rather than take over the sketch's buffer.
+int usb_xinput_try_send(const void *buffer, uint8_t nbytes)
+{
+	uint8_t *report;
+
+	if (!usb_configuration) {
+		report_forget();
+		return -1;
+	}
+	if (tx_acquired >= 0) return 0;
+	if (nbytes > XINPUT_TX_SIZE) nbytes = XINPUT_TX_SIZE;
+	if (report_unchanged(0, buffer, nbytes)) return nbytes;
+	report = usb_xinput_acquire();
+	if (!report) return 0;
+	memcpy(report, buffer, nbytes);
+	return usb_xinput_commit(nbytes);
+}
+
+// Only one controller is supported with the static report buffers
+int usb_xinput_try_send_to(uint8_t n, const void *buffer, uint8_t nbytes)
+{
+	if (n != 0) return -1;
+	return usb_xinput_try_send(buffer, nbytes);
+}
+
+int usb_xinput_send_all(const void * const *reports, uint8_t nbytes)
+{
+	int r;
+
+	if (reports[0] == NULL) return usb_configuration ? 0 : -1;
+	r = usb_xinput_try_send(reports[0], nbytes);
+	return (r > 0) ? 1 : r;
+}
+
+#else // XINPUT_TX_ZEROCOPY
+
+// Function sends a report for controller n if its queue has room,
+// without waiting
+int usb_xinput_try_send_to(uint8_t n, const void *buffer, uint8_t nbytes)
+{
+	usb_packet_t *tx_packet;
+
+	if (n >= XINPUT_COUNT) return -1;
+	if (!usb_configuration) {
+		report_forget();
+		return -1;
+	}
+	if (nbytes > XINPUT_TX_SIZE) nbytes = XINPUT_TX_SIZE;
+	if (report_unchanged(n, buffer, nbytes)) return nbytes;
+	// limited by the endpoint's quota, so we don't starve other endpoints
+	tx_packet = usb_malloc_tx(XINPUT_TX_ENDPOINT_N(n));
+	if (!tx_packet) return 0;
 	memcpy(tx_packet->buf, buffer, nbytes);
 	tx_packet->len = nbytes;
-	usb_tx(XINPUT_TX_ENDPOINT, tx_packet);
+	if (n == 0) latency_enqueue(0);
+	usb_tx(XINPUT_TX_ENDPOINT_N(n), tx_packet);
+	report_sent(n, buffer, nbytes);
 	return nbytes;
 }
 
+int usb_xinput_try_send(const void *buffer, uint8_t nbytes)
+{
+	return usb_xinput_try_send_to(0, buffer, nbytes);
+}
+
+// Function sends one report to each controller, all armed in the same
+// critical section so the host reads them in the same frame.  A NULL
+// entry skips that controller.  Either every report is accepted or
+// none are.  Returns the number of reports accepted (including those
+// skipped as unchanged), 0 if a queue is full, or -1 if not configured.
+int usb_xinput_send_all(const void * const *reports, uint8_t nbytes)
+{
+	usb_packet_t *packets[XINPUT_COUNT];
+	uint8_t endpoints[XINPUT_COUNT], which[XINPUT_COUNT];
+	uint32_t i, count = 0, unchanged = 0;
+
+	if (!usb_configuration) {
+		report_forget();
+		return -1;
+	}
+	if (nbytes > XINPUT_TX_SIZE) nbytes = XINPUT_TX_SIZE;
+	for (i=0; i < XINPUT_COUNT; i++) {
+		if (reports[i] == NULL) continue;
+		if (report_unchanged(i, reports[i], nbytes)) {
+			unchanged++;
+			continue;
+		}
+		packets[count] = usb_malloc_tx(XINPUT_TX_ENDPOINT_N(i));
+		if (packets[count] == NULL) {
+			while (count > 0) usb_free(packets[--count]);
+			return 0;
+		}
+		memcpy(packets[count]->buf, reports[i], nbytes);
+		packets[count]->len = nbytes;
+		endpoints[count] = XINPUT_TX_ENDPOINT_N(i);
+		which[count] = i;
+		count++;
+	}
+	if (count > 0) {
+		if (which[0] == 0) latency_enqueue(0);
+		usb_tx_group(count, endpoints, packets);
+	}
+	for (i=0; i < count; i++) {
+		report_sent(which[i], reports[which[i]], nbytes);
+	}
+	return count + unchanged;
+}
+
+#endif // XINPUT_TX_ZEROCOPY
+
+// Function used to send packets out of controller n's TX endpoint
+// This is used to send button reports
+int usb_xinput_send_to(uint8_t n, const void *buffer, uint8_t nbytes)
+{
+	int r;
+	uint32_t begin = millis();
+
+	while (1) {
+		r = usb_xinput_try_send_to(n, buffer, nbytes);
+		if (r != 0) return r;
+		if (millis() - begin > timeout) {
+#ifdef USB_STATS
+			usb_stats.send_timeouts++;
+#endif
+			return 0;
+		}
+		yield();
+	}
+}
+
+int usb_xinput_send(const void *buffer, uint8_t nbytes)
+{
+	return usb_xinput_send_to(0, buffer, nbytes);
+}
+
 #endif // F_CPU
 #endif // XINPUT_INTERFACE
\ No newline at end of file
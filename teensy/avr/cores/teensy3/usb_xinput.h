@@ -32,6 +32,43 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#ifdef XINPUT_LATENCY_STATS
+// Report latency, measured with usb_cycle_count().  Each histogram has
+// buckets XINPUT_LATENCY_BUCKET_US wide; the last bucket also counts
+// everything longer.
+#ifndef XINPUT_LATENCY_BUCKETS
+#define XINPUT_LATENCY_BUCKETS		16
+#endif
+#ifndef XINPUT_LATENCY_BUCKET_US
+#define XINPUT_LATENCY_BUCKET_US	125
+#endif
+typedef struct {
+	uint32_t count;				// reports measured
+	uint32_t deadline_misses;		// total latency over the deadline
+	uint32_t max_us;			// worst total latency
+	uint32_t queued[XINPUT_LATENCY_BUCKETS];	// send to BDT armed
+	uint32_t wire[XINPUT_LATENCY_BUCKETS];		// BDT armed to transmit complete
+	uint32_t total[XINPUT_LATENCY_BUCKETS];		// send to transmit complete
+} usb_xinput_latency_t;
+#endif
+
+#ifdef XINPUT_RX_PARSE
+// Latest rumble and LED settings sent by the host
+typedef struct {
+	uint8_t led;			// LED pattern, 0x00 to 0x0D
+	uint8_t rumble_left;		// large motor speed
+	uint8_t rumble_right;		// small motor speed
+	uint8_t led_count;		// incremented by each LED message
+	uint8_t rumble_count;		// incremented by each rumble message
+} usb_xinput_output_t;
+#endif
+
+// One received packet, filled in by usb_xinput_recv_batch()
+typedef struct {
+	uint8_t len;
+	uint8_t data[XINPUT_RX_BUFFER_SIZE];
+} usb_xinput_packet_t;
+
 // C language implementation
 #ifdef __cplusplus
 extern "C" {
@@ -39,8 +76,39 @@ extern "C" {
 bool usb_xinput_connected(void);
 uint16_t usb_xinput_available(void);
 int usb_xinput_send(const void *buffer, uint8_t nbytes);
+int usb_xinput_try_send(const void *buffer, uint8_t nbytes);
+int usb_xinput_send_to(uint8_t n, const void *buffer, uint8_t nbytes);
+int usb_xinput_try_send_to(uint8_t n, const void *buffer, uint8_t nbytes);
+int usb_xinput_send_all(const void * const *reports, uint8_t nbytes);
+uint16_t usb_xinput_available_from(uint8_t n);
+int usb_xinput_recv_from(uint8_t n, void *buffer, uint8_t nbytes);
+void usb_xinput_set_change_only(uint8_t enable, uint16_t keepalive_ms);
+uint16_t usb_xinput_frame_number(void);
+uint32_t usb_xinput_frame_cycles(void);
+uint32_t usb_xinput_frame_phase(void);
+int usb_xinput_wait_frame_phase(uint16_t lead_us);
 int usb_xinput_recv(void *buffer, uint8_t nbytes);
+int usb_xinput_recv_batch(usb_xinput_packet_t *packets, uint8_t max);
+uint16_t usb_xinput_available_packets(void);
 extern void (*usb_xinput_recv_callback)(void);
+extern void (*usb_xinput_packet_callback)(const void *data, uint8_t len);
+void usb_xinput_release(const void *data);
+extern void (*usb_xinput_tx_callback)(void);
+int usb_xinput_set_frame_callback(void (*callback)(void));
+int usb_xinput_add_frame_handler(void (*handler)(void), uint16_t divisor);
+void usb_xinput_remove_frame_handler(void (*handler)(void));
+#ifdef XINPUT_LATENCY_STATS
+void usb_xinput_latency_read(usb_xinput_latency_t *stats);
+void usb_xinput_latency_reset(void);
+void usb_xinput_set_latency_deadline(uint32_t deadline_us);
+#endif
+#ifdef XINPUT_RX_PARSE
+void usb_xinput_read_output(usb_xinput_output_t *out);
+#endif
+#ifdef XINPUT_TX_ZEROCOPY
+void * usb_xinput_acquire(void);
+int usb_xinput_commit(uint8_t nbytes);
+#endif
 #ifdef __cplusplus
 }
 #endif
@@ -54,8 +122,43 @@ public:
 	static bool connected(void) { return usb_xinput_connected(); }
 	static uint16_t available(void) { return usb_xinput_available(); }
 	static int send(const void *buffer, uint8_t nbytes) { return usb_xinput_send(buffer, nbytes); }
+	static int trySend(const void *buffer, uint8_t nbytes) { return usb_xinput_try_send(buffer, nbytes); }
+	static void setChangeOnly(bool enable, uint16_t keepalive_ms = 0) { usb_xinput_set_change_only(enable, keepalive_ms); }
 	static int recv(void *buffer, uint8_t nbytes) { return usb_xinput_recv(buffer, nbytes); }
+	// Controller n of XINPUT_COUNT, for USB types with more than one
+	static uint8_t count(void) { return XINPUT_COUNT; }
+	static uint16_t available(uint8_t n) { return usb_xinput_available_from(n); }
+	static int send(uint8_t n, const void *buffer, uint8_t nbytes) { return usb_xinput_send_to(n, buffer, nbytes); }
+	static int trySend(uint8_t n, const void *buffer, uint8_t nbytes) { return usb_xinput_try_send_to(n, buffer, nbytes); }
+	static int sendAll(const void * const *reports, uint8_t nbytes) { return usb_xinput_send_all(reports, nbytes); }
+	static int recv(uint8_t n, void *buffer, uint8_t nbytes) { return usb_xinput_recv_from(n, buffer, nbytes); }
+	static int recvBatch(usb_xinput_packet_t *packets, uint8_t max) { return usb_xinput_recv_batch(packets, max); }
+	static uint16_t availablePackets(void) { return usb_xinput_available_packets(); }
 	static void setRecvCallback(void (*callback)(void)) { usb_xinput_recv_callback = callback; }
+	static void setPacketCallback(void (*callback)(const void *data, uint8_t len)) { usb_xinput_packet_callback = callback; }
+	static void release(const void *data) { usb_xinput_release(data); }
+	static void setTransmitCallback(void (*callback)(void)) { usb_xinput_tx_callback = callback; }
+	static int setFrameCallback(void (*callback)(void)) { return usb_xinput_set_frame_callback(callback); }
+	// Any number of handlers, up to USB_SOF_HANDLERS, each called every
+	// divisor frames
+	static int addFrameHandler(void (*handler)(void), uint16_t divisor = 1) { return usb_xinput_add_frame_handler(handler, divisor); }
+	static void removeFrameHandler(void (*handler)(void)) { usb_xinput_remove_frame_handler(handler); }
+	static uint16_t frameNumber(void) { return usb_xinput_frame_number(); }
+	static uint32_t frameCycles(void) { return usb_xinput_frame_cycles(); }
+	static uint32_t framePhase(void) { return usb_xinput_frame_phase(); }
+	static int waitFramePhase(uint16_t lead_us) { return usb_xinput_wait_frame_phase(lead_us); }
+#ifdef XINPUT_LATENCY_STATS
+	static void latencyStats(usb_xinput_latency_t *stats) { usb_xinput_latency_read(stats); }
+	static void resetLatencyStats(void) { usb_xinput_latency_reset(); }
+	static void setLatencyDeadline(uint32_t deadline_us) { usb_xinput_set_latency_deadline(deadline_us); }
+#endif
+#ifdef XINPUT_RX_PARSE
+	static void readOutput(usb_xinput_output_t *out) { usb_xinput_read_output(out); }
+#endif
+#ifdef XINPUT_TX_ZEROCOPY
+	static void * acquire(void) { return usb_xinput_acquire(); }
+	static int commit(uint8_t nbytes) { return usb_xinput_commit(nbytes); }
+#endif
 };
 
 #endif // __cplusplus